@@ -0,0 +1,158 @@
+/* Floods a running server with replies: CLIENTS clients join, which sends
+ * every one of them the whole roster, then SENDERS of them chat once each,
+ * which the server broadcasts to all. Run against a server with a small
+ * --ring-entries to fill its io_uring queues. Fails if a client stops
+ * receiving before it has every message. */
+#include "lib/common.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// Seconds without progress after which the run fails
+#define STALL_TIMEOUT 10
+
+typedef struct client_t {
+    int fd;
+    uint32_t id, key, features;
+    bool joined;
+    // SENDMSG's received from the others
+    uint32_t chats;
+    frame_reader_t fr;
+} client_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(const char *addr, uint16_t port) {
+    struct sockaddr_in sin = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+        panic("Invalid address: %s", addr);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        ppanic("socket()");
+    if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+        ppanic("connect()");
+    return fd;
+}
+
+/* Reads whatever the clients have for us, waiting up to timeout ms. Returns
+ * the number of replies of interest. */
+static size_t pump(client_t *clients, struct pollfd *pfds, size_t cnt,
+                   int timeout) {
+    if (poll(pfds, cnt, timeout) < 0 && errno != EINTR)
+        ppanic("poll()");
+    size_t progress = 0;
+    for (size_t i = 0; i < cnt; ++i) {
+        if (pfds[i].revents == 0)
+            continue;
+        client_t *c = &clients[i];
+        ssize_t r = frame_reader_recv(&c->fr, c->fd, MSG_DONTWAIT);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+            panic("Client %zu was disconnected", i);
+        message_t msg;
+        int res;
+        while ((res = frame_reader_next(&c->fr, &msg)) == 1) {
+            if (msg.head.kind == JOIN_R) {
+                if (msg.body.join_r.error != 0)
+                    panic("Client %zu could not join: %s", i,
+                          msg_strerror(msg.body.join_r.error));
+                c->id = msg.body.join_r.id;
+                c->key = msg.body.join_r.key;
+                c->features = msg.body.join_r.features;
+                c->joined = true;
+                ++progress;
+            } else if (msg.head.kind == SENDMSG &&
+                       msg.body.sendmsg.id != c->id) {
+                ++c->chats;
+                ++progress;
+            }
+        }
+        if (res < 0)
+            panic("Client %zu got a corrupted stream", i);
+    }
+    return progress;
+}
+
+/* Pumps until every client has joined and received a chat from each of the
+ * first want clients but itself. */
+static void wait_for(client_t *clients, struct pollfd *pfds, size_t cnt,
+                     uint32_t want, const char *what) {
+    double start = now(), last = start;
+    while (1) {
+        size_t left = 0;
+        for (size_t i = 0; i < cnt; ++i) {
+            uint32_t own = i < want ? 1 : 0;
+            left += !clients[i].joined || clients[i].chats + own < want;
+        }
+        if (left == 0)
+            break;
+        if (pump(clients, pfds, cnt, 100))
+            last = now();
+        else if (now() - last > STALL_TIMEOUT)
+            panic("%s stalled with %zu clients waiting", what, left);
+    }
+    printf("%-10s %8.3f s\n", what, now() - start);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s ADDR PORT CLIENTS SENDERS\n", argv[0]);
+        return 2;
+    }
+    const char *addr = argv[1];
+    uint16_t port = atoi(argv[2]);
+    size_t cnt = strtoul(argv[3], NULL, 10);
+    uint32_t senders = strtoul(argv[4], NULL, 10);
+    if (cnt == 0 || senders > cnt) {
+        fprintf(stderr, "Need 0 < SENDERS <= CLIENTS\n");
+        return 2;
+    }
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    client_t *clients = xcalloc(cnt, sizeof(*clients));
+    struct pollfd *pfds = xcalloc(cnt, sizeof(*pfds));
+    for (size_t i = 0; i < cnt; ++i) {
+        client_t *c = &clients[i];
+        c->fd = connect_to(addr, port);
+        frame_reader_init(&c->fr);
+        char nick[NICKNAME_LEN];
+        snprintf(nick, sizeof(nick), "stress%zu", i);
+        message_t *msg = make_join(nick);
+        if (msg_send(c->fd, msg, MSG_FEATURES & ~MSG_FEAT_ID32) != 0)
+            panic("Could not send JOIN");
+        msg_free(msg);
+        pfds[i] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+        // Keep up with the roster while the rest connect
+        pump(clients, pfds, i + 1, 0);
+    }
+    wait_for(clients, pfds, cnt, 0, "join");
+
+    for (uint32_t i = 0; i < senders; ++i) {
+        client_t *c = &clients[i];
+        message_t *msg = make_msg_buf(SENDMSG);
+        msg->body.sendmsg.id = c->id;
+        msg->body.sendmsg.key = c->key;
+        snprintf(msg->body.sendmsg.text, sizeof(msg->body.sendmsg.text),
+                 "stress %u", i);
+        if (msg_send(c->fd, msg, c->features) != 0)
+            panic("Could not send SENDMSG");
+        msg_free(msg);
+    }
+    wait_for(clients, pfds, cnt, senders, "broadcast");
+
+    for (size_t i = 0; i < cnt; ++i)
+        close(clients[i].fd);
+    free(pfds);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/* Compares queue_t with mpsc_queue_t: P producers add ITEMS entries in all
+ * while one consumer takes them the way the server's game thread does. */
+#include "lib/common.h"
+
+#define ITEMS (1u << 21)
+#define QUEUE_CAP 65536
+#define BATCH 64
+
+typedef struct producer_arg_t {
+    void *queue;
+    bool mpsc;
+    size_t cnt;
+} producer_arg_t;
+
+static void *producer(void *parg) {
+    producer_arg_t *arg = parg;
+    for (size_t i = 1; i <= arg->cnt; ++i) {
+        void *e = (void *)(uintptr_t)i;
+        if (arg->mpsc)
+            mpsc_add(arg->queue, e, true);
+        else
+            queue_add(arg->queue, e, true);
+    }
+    return 0;
+}
+
+/* Takes total entries and returns how long the run took in seconds. */
+static double run(bool mpsc, unsigned producers) {
+    void *queue = mpsc ? (void *)mpsc_create(QUEUE_CAP)
+                       : (void *)queue_create(QUEUE_CAP);
+    size_t per = ITEMS / producers, total = per * producers;
+    pthread_t *threads = xcalloc(producers, sizeof(*threads));
+    producer_arg_t arg = {.queue = queue, .mpsc = mpsc, .cnt = per};
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < producers; ++i) {
+        if (pthread_create(&threads[i], NULL, producer, &arg) != 0)
+            ppanic("pthread_create()");
+    }
+    for (size_t taken = 0; taken < total;) {
+        void *batch[BATCH];
+        if (mpsc) {
+            taken += mpsc_take_batch(queue, batch, BATCH, true);
+        } else {
+            // One blocking take, then whatever else is ready
+            queue_take(queue, &batch[0], true);
+            size_t n = 1;
+            while (n < BATCH && queue_take(queue, &batch[n], false) == QOK)
+                ++n;
+            taken += n;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (unsigned i = 0; i < producers; ++i)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    if (mpsc)
+        mpsc_destroy(queue);
+    else
+        queue_destroy(queue);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main() {
+    printf("%9s %14s %14s\n", "producers", "queue_t Mop/s", "mpsc Mop/s");
+    for (unsigned p = 1; p <= 64; p *= 2) {
+        size_t total = ITEMS / p * p;
+        double locked = run(false, p), lockfree = run(true, p);
+        printf("%9u %14.2f %14.2f\n", p, total / locked / 1e6,
+               total / lockfree / 1e6);
+    }
+    return 0;
+}
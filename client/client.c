@@ -5,11 +5,16 @@
 #include <ncurses.h>
 #include <panel.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 
 #define QSIZE 4096
+// Most entries moved from a queue at once
+#define QBATCH 64
 #define TICKS_PER_SEC 100
 #define NANOSEC_PER_SEC 1000000000
+// Users in the roster window subscribed to, and the step of paging
+#define ROSTER_WINDOW 50
 
 /* INTERFACE SPECS */
 const int ROOT_Y = 0, ROOT_X = 0;
@@ -57,14 +62,18 @@ const char *APPNAME = "game_client";
 char initial_addr[ADDR_MAX_LEN] = "127.0.0.1";
 uint32_t initial_port = DEFAULT_PORT;
 typedef enum net_thread_kind_t { IN, OUT } net_thread_kind_t;
+// MSG_FEAT_* accepted by the server, learnt from JOIN_R
+static atomic_uint server_features;
 
 typedef struct io_arg_t {
     int fd;
     net_thread_kind_t kind;
     /* For IN: Receive packets and store into queue
        For OUT: Take packets from queue and send to server_fd
+       The io_worker is the queue's only producer or consumer, and the UI
+       the other side.
      */
-    queue_t *queue;
+    spsc_ring_t *queue;
 } io_arg_t;
 
 typedef struct ui_msg_t {
@@ -74,15 +83,19 @@ typedef struct ui_msg_t {
             net_thread_kind_t kind;
             int err;
         } disconn;
-        message_t message;
+        // From msg_dup(); freed with the ui_msg_t
+        message_t *msg;
     };
 } ui_msg_t;
 
+static pool_t ui_msg_pool = POOL_INITIALIZER("ui_msg_t", ui_msg_t);
+static pool_t user_pool = POOL_INITIALIZER("user_info_t", user_info_t);
+
 typedef enum ui_state_t { UI_INIT, UI_LOGIN, UI_MAIN, UI_EXIT } ui_state_t;
 
 typedef struct game_state_t {
     char nickname[NICKNAME_LEN], opponent_name[NICKNAME_LEN];
-    uint16_t id, opponent_id, chid;
+    uint32_t id, opponent_id, chid;
     bool is_user1;
     bool acted;
     uint32_t key;
@@ -97,6 +110,8 @@ typedef enum uc_kind_t {
     UC_CHL_USER,
     UC_BATTLE_ACT,
     UC_SORT,
+    UC_PAGE,
+    UC_LEADERBOARD,
     UC_QUIT,
     UC_SENDMSG,
     UC_MAX
@@ -108,15 +123,17 @@ typedef struct user_cmd_t {
     uc_kind_t kind;
     union {
         struct {
-            uint16_t chl_user_id;
+            uint32_t chl_user_id;
             // HACK: need this information for sorting
             int32_t chl_score;
             char chl_user_name[32];
         };
-        uint16_t acc_or_rej_chid;
+        uint32_t acc_or_rej_chid;
         char new_name[32];
         battle_act_t b_act;
         sort_by_t sort_by;
+        // Pages to move the roster window by
+        int page_delta;
         struct {
             const char **names;
             struct user_cmd_t **actions;
@@ -133,9 +150,9 @@ static void game_state_init(game_state_t *gs) {
     gs->user_by_id = NULL;
 }
 
-static user_info_t *user_create(const char *nickname, uint16_t id,
+static user_info_t *user_create(const char *nickname, uint32_t id,
                                 user_state_t state, int32_t score) {
-    user_info_t *user = xmalloc(sizeof(*user));
+    user_info_t *user = pool_alloc(&user_pool);
     user->id = id;
     user->state = state;
     user->score = score;
@@ -143,7 +160,7 @@ static user_info_t *user_create(const char *nickname, uint16_t id,
     return user;
 }
 
-static void user_destroy(user_info_t *user) { free(user); }
+static void user_destroy(user_info_t *user) { pool_free(&user_pool, user); }
 
 static void create_thread(pthread_t *thread, void *(*entry)(void *),
                           const void *arg, size_t arg_size) {
@@ -187,48 +204,87 @@ fail:
     return -1;
 }
 
+/* Takes entries from a ring a batch at a time and hands them out one by
+ * one */
+typedef struct ring_reader_t {
+    spsc_ring_t *ring;
+    void *batch[QBATCH];
+    size_t i, n;
+} ring_reader_t;
+
+/* Returns NULL once the ring is empty. */
+static void *ring_next(ring_reader_t *rd) {
+    if (rd->i == rd->n) {
+        rd->n = spsc_try_take_batch(rd->ring, rd->batch, QBATCH);
+        rd->i = 0;
+        if (rd->n == 0)
+            return NULL;
+    }
+    return rd->batch[rd->i++];
+}
+
 static void *io_worker(void *parg) {
     io_arg_t arg = *(io_arg_t *)parg;
 
     switch (arg.kind) {
-    case IN:
+    case IN: {
+        frame_reader_t rd;
+        frame_reader_init(&rd);
         while (1) {
             message_t msg;
-            if (msg_recv(arg.fd, &msg, true) == 0) {
-                ui_msg_t *ui_msg = xmalloc(sizeof(*ui_msg));
+            int res;
+            while ((res = frame_reader_next(&rd, &msg)) > 0) {
+                if (msg.head.kind == JOIN_R && msg.body.join_r.error == ME_OK)
+                    atomic_store(&server_features, msg.body.join_r.features);
+                ui_msg_t *ui_msg = pool_alloc(&ui_msg_pool);
                 ui_msg->kind = UM_RECV;
-                memcpy(&ui_msg->message, &msg, sizeof(msg));
-                queue_add(arg.queue, ui_msg, true);
-            } else {
-                break;
+                ui_msg->msg = msg_dup(&msg);
+                spsc_stage(arg.queue, ui_msg);
             }
+            // Hand over everything one recv() brought at once
+            spsc_publish(arg.queue);
+            if (res < 0 || frame_reader_recv(&rd, arg.fd, 0) <= 0)
+                break;
         }
-        break;
-    case OUT:
+    } break;
+    case OUT: {
+        void *batch[QBATCH];
+        size_t n = 0, i = 0;
         while (1) {
-            void *p;
-            message_t *msg;
-            if (queue_take(arg.queue, &p, true) == QOK) {
-                msg = p;
-                log_info("Sending: %d", arg.fd);
-                int err = msg_send(arg.fd, msg);
-                free(msg);
-                if (err != 0) {
-                    log_error("Send error: %d", err);
-                    break;
-                }
+            if (i == n) {
+                n = spsc_take_batch(arg.queue, batch, QBATCH);
+                i = 0;
+            }
+            message_t *msg = batch[i++];
+            log_info("Sending: %d", arg.fd);
+            // JOIN is sent before the server is known and has no ids
+            uint32_t features = msg->head.kind == JOIN
+                                    ? MSG_FEATURES & ~MSG_FEAT_ID32
+                                    : atomic_load(&server_features);
+            int err = msg_send(arg.fd, msg, features);
+            msg_free(msg);
+            if (err != 0) {
+                log_error("Send error: %d", err);
+                break;
             }
         }
-        break;
+        // The rest of the batch is never sent
+        while (i < n)
+            msg_free(batch[i++]);
+    } break;
     default:
         assert(0);
     }
 
-    ui_msg_t *um = xmalloc(sizeof(*um));
-    um->kind = UM_DISCONN;
-    um->disconn.kind = arg.kind;
-    um->disconn.err = errno;
-    queue_add(arg.queue, um, true);
+    // Only IN has the UI on the consuming side; it also sees the end of the
+    // connection when sending fails
+    if (arg.kind == IN) {
+        ui_msg_t *um = pool_alloc(&ui_msg_pool);
+        um->kind = UM_DISCONN;
+        um->disconn.kind = arg.kind;
+        um->disconn.err = errno;
+        spsc_add(arg.queue, um);
+    }
     log_info("Disconnected: %d (%d)", arg.fd, arg.kind);
     free(parg);
     return 0;
@@ -288,8 +344,8 @@ static void draw_login_scr(WINDOW *win) {
     print_centered(win, gety(win) + 2, true, "%s", please_login);
 }
 
-static ui_state_t ui_init(WINDOW **proot, queue_t **pum_queue,
-                          queue_t **psend_queue) {
+static ui_state_t ui_init(WINDOW **proot, spsc_ring_t **pum_queue,
+                          spsc_ring_t **psend_queue) {
     if (*proot) {
         delwin(*proot);
     }
@@ -301,8 +357,8 @@ static ui_state_t ui_init(WINDOW **proot, queue_t **pum_queue,
     wrefresh(*proot);
 
     // TODO: destroy the previous queues; free messages in them
-    *pum_queue = queue_create(QSIZE);
-    *psend_queue = queue_create(QSIZE);
+    *pum_queue = spsc_create(QSIZE);
+    *psend_queue = spsc_create(QSIZE);
 
     if (noecho() == ERR)
         ppanic("noecho()");
@@ -311,7 +367,7 @@ static ui_state_t ui_init(WINDOW **proot, queue_t **pum_queue,
 }
 
 static ui_state_t ui_login(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
-                           queue_t *um_queue, queue_t *send_queue,
+                           spsc_ring_t *um_queue, spsc_ring_t *send_queue,
                            message_t **join_msg) {
     ui_state_t next_state = UI_MAIN;
     WINDOW *win = derwin(root, MAIN_HEIGHT, MAIN_WIDTH, 1, 1);
@@ -403,14 +459,14 @@ static ui_state_t ui_login(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
         case SEND_JOIN: {
             assert(connected);
             message_t *msg = make_join(nick_buf);
-            queue_add(send_queue, msg, true);
+            spsc_add(send_queue, msg);
             strcpy(info, "Waiting for server reply...");
             state = WAIT_MSG;
         } break;
         case WAIT_MSG: {
             void *p;
             ui_msg_t *ui_msg;
-            if (queue_take(um_queue, &p, true) == QOK) {
+            if (spsc_take_batch(um_queue, &p, 1)) {
                 ui_msg = p;
                 switch (ui_msg->kind) {
                 case UM_DISCONN:
@@ -423,12 +479,13 @@ static ui_state_t ui_login(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                     connected = false;
                     break;
                 case UM_RECV: {
-                    message_t *msg = &ui_msg->message;
+                    message_t *msg = ui_msg->msg;
                     if (msg->head.kind == JOIN_R) {
                         msg_join_r_t *r = &msg->body.join_r;
                         if (r->error == ME_OK) {
                             snprintf(info, sizeof(info), "OK!");
-                            *join_msg = msg_dup(msg);
+                            *join_msg = msg;
+                            ui_msg->msg = NULL;
                             state = SUCCESS;
                         } else {
                             snprintf(info, sizeof(info), "Cannot join: %s",
@@ -439,9 +496,10 @@ static ui_state_t ui_login(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                         snprintf(info, sizeof(info), "What's this? %d",
                                  msg->head.kind);
                     }
+                    msg_free(ui_msg->msg);
                 } break;
                 }
-                free(ui_msg);
+                pool_free(&ui_msg_pool, ui_msg);
             }
         } break;
         case SUCCESS: {
@@ -465,9 +523,9 @@ static ui_state_t ui_login(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
 typedef struct populate_arg_t {
     size_t idx, sz;
     ITEM **items;
-    uint16_t *selection_id;
+    uint32_t *selection_id;
     ITEM *selection;
-    uint16_t self_id;
+    uint32_t self_id;
 } populate_arg_t;
 
 char user_state_char(user_state_t st) {
@@ -478,6 +536,8 @@ char user_state_char(user_state_t st) {
         return '+';
     case UBATTLING:
         return 'X';
+    case UHIDDEN:
+        break;
     }
     return '?';
 }
@@ -508,7 +568,7 @@ void populate_user_list(const void *pnode, VISIT vis, void *parg) {
     }
 }
 
-void draw_user_state_subwin(WINDOW *subwin, void *const *rootp, uint16_t id,
+void draw_user_state_subwin(WINDOW *subwin, void *const *rootp, uint32_t id,
                             int32_t hp, int32_t maxhp) {
     user_info_t tmp = {.id = id};
     const user_info_t *user = deref_or_null(tfind(&tmp, rootp, cmp_by_id));
@@ -662,8 +722,21 @@ int cmp_item_for_sort(const void *p, const void *q, void *psb) {
     }
 }
 
+static void send_subscribe(spsc_ring_t *send_queue, const game_state_t *gs,
+                           sort_by_t sort_by, uint32_t offset) {
+    message_t *msg = make_msg_buf(SUBSCRIBE);
+    msg->body.subscribe.id = gs->id;
+    msg->body.subscribe.key = gs->key;
+    msg->body.subscribe.order = sort_by == BY_NAME ? RO_NAME : RO_SCORE;
+    msg->body.subscribe.offset = offset;
+    msg->body.subscribe.limit = ROSTER_WINDOW;
+    spsc_add(send_queue, msg);
+}
+
+static void free_user(void *user) { user_destroy(user); }
+
 static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
-                          queue_t *um_queue, queue_t *send_queue,
+                          spsc_ring_t *um_queue, spsc_ring_t *send_queue,
                           message_t *join_msg) {
     game_state_t gs;
     game_state_init(&gs);
@@ -714,11 +787,15 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
     touchwin(main_win);
     wrefresh(arena);
 
-    static const char *main_act_names[] = {"Sort By Name", "Sort By Score",
-                                           "Quit", 0};
+    static const char *main_act_names[] = {
+        "Sort By Name", "Sort By Score", "Previous Page", "Next Page",
+        "Leaderboard",  "Quit",          0};
     const static user_cmd_t main_menu_actions[] = {
         {.kind = UC_SORT, .sort_by = BY_NAME},
         {.kind = UC_SORT, .sort_by = BY_SCORE},
+        {.kind = UC_PAGE, .page_delta = -1},
+        {.kind = UC_PAGE, .page_delta = 1},
+        {.kind = UC_LEADERBOARD},
         {.kind = UC_QUIT},
         {.kind = UC_MAX}};
 
@@ -849,20 +926,27 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
             unfocus(foci + i);
     }
 
-    enum { W_NONE, W_CANCEL, W_ACCEPT } waiting_for = W_NONE;
+    enum { W_NONE, W_CANCEL, W_ACCEPT, W_DISMISS } waiting_for = W_NONE;
     sort_by_t sort_by = BY_SCORE;
+    // With a server that supports it, only a window of the roster is kept
+    const bool subscribed =
+        join_msg->body.join_r.features & MSG_FEAT_SUBSCRIBE;
+    uint32_t roster_offset = 0, roster_total = 0;
+    if (subscribed)
+        send_subscribe(send_queue, &gs, sort_by, roster_offset);
+    const bool has_leaderboard =
+        join_msg->body.join_r.features & MSG_FEAT_LEADERBOARD;
 
     while (1) {
-        void *p;
+        ring_reader_t rd = {.ring = um_queue};
         ui_msg_t *um;
-        while (queue_take(um_queue, &p, false) == QOK) {
-            um = p;
+        while ((um = ring_next(&rd)) != NULL) {
             switch (um->kind) {
             case UM_DISCONN:
                 goto done;
                 break;
             case UM_RECV: {
-                message_t *msg = &um->message;
+                message_t *msg = um->msg;
                 switch (msg->head.kind) {
                 case SENDMSG: {
                     user_info_t *user;
@@ -871,7 +955,14 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                         user =
                             deref_or_null(tfind(&tmp, &user_by_id, cmp_by_id));
                     }
-                    const char *sender = user ? user->nickname : "<unknown>";
+                    // Senders out of the subscribed window are not known
+                    char sender[NICKNAME_LEN + 16];
+                    if (user) {
+                        snprintf(sender, sizeof(sender), "%s", user->nickname);
+                    } else {
+                        snprintf(sender, sizeof(sender), "User #%u",
+                                 msg->body.sendmsg.id);
+                    }
                     wprintw(chat_sub, "%s%s said: %s\n", sender,
                             msg->body.sendmsg.id == gs.id ? " (You)" : "",
                             msg->body.sendmsg.text);
@@ -958,7 +1049,7 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                                                   .key = gs.key};
                             message_t *msg = make_challenge();
                             msg->body.challenge = ch;
-                            queue_add(send_queue, msg, true);
+                            spsc_add(send_queue, msg);
                         }
                         break;
                     default:
@@ -973,7 +1064,7 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                         waiting_for = W_NONE;
                         hide_panel(popup_panel);
                         update_panels();
-                        int32_t op;
+                        uint32_t op;
                         if (chr->is_id1) {
                             op = chr->id2;
                             gs.is_user1 = true;
@@ -1027,7 +1118,8 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                             }
                             user_state_updated = true;
                         }
-                        if (changes->users[i].id == gs.opponent_id) {
+                        if (changes->users[i].id == gs.opponent_id &&
+                            changes->users[i].state != UHIDDEN) {
                             snprintf(gs.opponent_name, NICKNAME_LEN, "%s",
                                      changes->users[i].nickname);
                             user_state_updated = true;
@@ -1040,13 +1132,17 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                                 changes->users[i].score);
                             user_info_t **node =
                                 tfind(user, &user_by_id, cmp_by_id);
-                            if (changes->users[i].state == UOFFLINE) {
-                                // User goes offline
+                            if (changes->users[i].state == UOFFLINE ||
+                                changes->users[i].state == UHIDDEN) {
+                                // User goes offline or out of the window
                                 log_info("User %u becomes offline", user->id);
-                                wprintw(chat_sub, "User `%s' goes offline\n",
-                                        changes->users[i].nickname);
-                                touchwin(main_win);
-                                wrefresh(chat_sub);
+                                if (changes->users[i].state == UOFFLINE) {
+                                    wprintw(chat_sub,
+                                            "User `%s' goes offline\n",
+                                            changes->users[i].nickname);
+                                    touchwin(main_win);
+                                    wrefresh(chat_sub);
+                                }
                                 if (node) {
                                     user_info_t *ptr = *node;
                                     tdelete(ptr, &user_by_id, cmp_by_id);
@@ -1067,10 +1163,14 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                                 } else {
                                     // New user
                                     log_info("User %u is new", user->id);
-                                    wprintw(chat_sub, "User `%s' joined\n",
-                                            changes->users[i].nickname);
-                                    touchwin(main_win);
-                                    wrefresh(chat_sub);
+                                    // Subscribers see users enter the window
+                                    if (!subscribed) {
+                                        wprintw(chat_sub,
+                                                "User `%s' joined\n",
+                                                changes->users[i].nickname);
+                                        touchwin(main_win);
+                                        wrefresh(chat_sub);
+                                    }
                                     user_info_t **node =
                                         tsearch(user, &user_by_id, cmp_by_id);
                                     assert(node);
@@ -1083,8 +1183,65 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                         log_info("User cnt becomes %zu", user_cnt);
                     }
                 } break;
+                case SUBSCRIBE_R: {
+                    msg_subscribe_r_t *r = &msg->body.subscribe_r;
+                    if (r->error != ME_OK) {
+                        wprintw(chat_sub, "Cannot list users: %s\n",
+                                msg_strerror(r->error));
+                        touchwin(main_win);
+                        wrefresh(chat_sub);
+                        break;
+                    }
+                    // The window is sent again from scratch
+                    tdestroy(user_by_id, free_user);
+                    user_by_id = NULL;
+                    user_cnt = 0;
+                    roster_offset = r->offset;
+                    roster_total = r->total;
+                    user_list_updated = true;
+                } break;
+                case UCOUNT:
+                    roster_total = msg->body.ucount.total;
+                    user_list_updated = true;
+                    break;
+                case LEADERBOARD_R: {
+                    msg_leaderboard_r_t *r = &msg->body.leaderboard_r;
+                    if (r->error != ME_OK) {
+                        wprintw(chat_sub, "Cannot show leaderboard: %s\n",
+                                msg_strerror(r->error));
+                        touchwin(main_win);
+                        wrefresh(chat_sub);
+                        break;
+                    }
+                    if (waiting_for != W_NONE) {
+                        // The popup is taken
+                        wprintw(chat_sub,
+                                "Cannot show leaderboard while a popup is "
+                                "open; ask again later\n");
+                        touchwin(main_win);
+                        wrefresh(chat_sub);
+                        break;
+                    }
+                    waiting_for = W_DISMISS;
+                    wclear(popup_sub);
+                    for (uint32_t i = 0; i < r->count; ++i) {
+                        const msg_uchange_user_t *u = &r->users[i];
+                        print_centered(popup_sub, i, false, "%4u. %-*s %8d",
+                                       r->offset + i + 1, NICKNAME_LEN - 1,
+                                       u->nickname, u->score);
+                    }
+                    print_centered(popup_sub, POPUP_HEIGHT - 3, false,
+                                   "You are #%u of %u (press any key)",
+                                   r->rank, r->total);
+                    touchwin(popup_win);
+                    wrefresh(popup_sub);
+                    show_panel(popup_panel);
+                    update_panels();
+                    doupdate();
+                } break;
                 }
-                free(um);
+                msg_free(msg);
+                pool_free(&ui_msg_pool, um);
             } break;
             }
         }
@@ -1093,9 +1250,9 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
             ITEM **old_items = menu_items(user_list_menu),
                  **items = xcalloc(user_cnt + 1, sizeof(ITEM *));
             ITEM *selection = current_item(user_list_menu);
-            uint16_t old_id, *maybe_old_id;
+            uint32_t old_id, *maybe_old_id;
             if (selection) {
-                old_id = *(uint16_t *)item_userptr(selection);
+                old_id = ((user_cmd_t *)item_userptr(selection))->chl_user_id;
                 maybe_old_id = &old_id;
             } else {
                 maybe_old_id = NULL;
@@ -1127,7 +1284,22 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                 free(old_items);
             }
             box(user_list_win, 0, 0);
-            print_centered(user_list_win, 0, false, "Users (%zu)", user_cnt);
+            if (subscribed) {
+                char title[64];
+                uint32_t first = min_(roster_offset + 1, roster_total),
+                         last = min_(roster_offset + ROSTER_WINDOW,
+                                     roster_total);
+                snprintf(title, sizeof(title), "Users %u-%u/%u", first, last,
+                         roster_total);
+                if (strlen(title) > USER_LIST_WIDTH - 2) {
+                    snprintf(title, sizeof(title), "%u-%u/%u", first, last,
+                             roster_total);
+                }
+                print_centered(user_list_win, 0, false, "%s", title);
+            } else {
+                print_centered(user_list_win, 0, false, "Users (%zu)",
+                               user_cnt);
+            }
             post_menu(user_list_menu);
             touchwin(main_win);
             wrefresh(user_list_win);
@@ -1152,7 +1324,7 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                 msg->body.challenge.id2 = gs.opponent_id;
                 msg->body.challenge.chid = 0;
                 msg->body.challenge.key = gs.key;
-                queue_add(send_queue, msg, true);
+                spsc_add(send_queue, msg);
                 hide_panel(popup_panel);
                 update_panels();
                 doupdate();
@@ -1171,7 +1343,12 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                 }
                 message_t *msg = make_challenge();
                 msg->body.challenge = ch;
-                queue_add(send_queue, msg, true);
+                spsc_add(send_queue, msg);
+                hide_panel(popup_panel);
+                update_panels();
+                doupdate();
+                waiting_for = W_NONE;
+            } else if (waiting_for == W_DISMISS) {
                 hide_panel(popup_panel);
                 update_panels();
                 doupdate();
@@ -1207,7 +1384,7 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                                               .key = gs.key};
                         message_t *msg = make_challenge();
                         msg->body.challenge = ch;
-                        queue_add(send_queue, msg, true);
+                        spsc_add(send_queue, msg);
                         waiting_for = W_CANCEL;
                         wclear(popup_sub);
                         print_centered(popup_sub, 3, false,
@@ -1238,7 +1415,7 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                                                .user = gs.id};
                             gs.acted = true;
                             msg->body.turn = turn;
-                            queue_add(send_queue, msg, true);
+                            spsc_add(send_queue, msg);
                             wprintw(battle_msg_sub,
                                     "You've chosen %s. Waiting for the other "
                                     "user.\n",
@@ -1250,7 +1427,43 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                     case UC_SORT:
                         sort_by = cmd->sort_by;
                         user_list_updated = true;
+                        if (subscribed) {
+                            roster_offset = 0;
+                            send_subscribe(send_queue, &gs, sort_by,
+                                           roster_offset);
+                        }
                         break;
+                    case UC_PAGE:
+                        if (!subscribed)
+                            break;
+                        if (cmd->page_delta < 0) {
+                            roster_offset -=
+                                min_(roster_offset, (uint32_t)ROSTER_WINDOW);
+                        } else if (roster_offset + ROSTER_WINDOW <
+                                   roster_total) {
+                            roster_offset += ROSTER_WINDOW;
+                        } else {
+                            break;
+                        }
+                        send_subscribe(send_queue, &gs, sort_by,
+                                       roster_offset);
+                        break;
+                    case UC_LEADERBOARD: {
+                        if (!has_leaderboard) {
+                            wprintw(chat_sub, "The server keeps no "
+                                              "leaderboard.\n");
+                            touchwin(main_win);
+                            wrefresh(chat_sub);
+                            break;
+                        }
+                        message_t *msg = make_msg_buf(LEADERBOARD);
+                        msg->body.leaderboard.id = gs.id;
+                        msg->body.leaderboard.key = gs.key;
+                        msg->body.leaderboard.offset = 0;
+                        // The popup leaves a row for the user's own rank
+                        msg->body.leaderboard.limit = POPUP_HEIGHT - 4;
+                        spsc_add(send_queue, msg);
+                    } break;
                     case UC_SENDMSG: {
                         message_t *msg = make_msg_buf(SENDMSG);
                         msg->body.sendmsg.id = gs.id;
@@ -1263,7 +1476,7 @@ static ui_state_t ui_main(WINDOW *root, pthread_t *pprecv, pthread_t *ppsend,
                                isspace(msg->body.sendmsg.text[sz - 1])) {
                             msg->body.sendmsg.text[--sz] = '\0';
                         }
-                        queue_add(send_queue, msg, true);
+                        spsc_add(send_queue, msg);
                         form_driver(chat_input, REQ_CLR_FIELD);
                     } break;
                     case UC_QUIT:
@@ -1317,7 +1530,7 @@ done:
         message_t *quit = make_msg_buf(QUIT);
         quit->body.quit.id = gs.id;
         quit->body.quit.key = gs.key;
-        queue_add(send_queue, quit, true);
+        spsc_add(send_queue, quit);
     }
     return UI_INIT;
 }
@@ -1329,7 +1542,7 @@ static void *ui(void *_arg) {
         ppanic("cbreak()");
 
     WINDOW *root = NULL;
-    queue_t *um_queue = NULL, *send_queue = NULL;
+    spsc_ring_t *um_queue = NULL, *send_queue = NULL;
     ui_state_t state = UI_INIT;
     pthread_t precv, psend;
     message_t *join_msg;
@@ -1367,11 +1580,12 @@ int main(int argc, char **argv) {
     setlocale(LC_ALL, "");
 
     parse_args(argc, argv, initial_addr, ADDR_MAX_LEN, &initial_port,
-               argc == 0 ? APPNAME : argv[0], "SERVER_ADDR");
+               argc == 0 ? APPNAME : argv[0], "SERVER_ADDR", NULL);
     signal_handlers_init();
 
     pthread_t pui;
     create_thread(&pui, ui, NULL, 0);
 
     pthread_join(pui, NULL);
+    pool_log_stats();
 }
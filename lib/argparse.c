@@ -5,25 +5,74 @@ const static struct option long_options[] = {
     {"port", required_argument, 0, 'p'},
     {"loglevel", required_argument, 0, 'l'},
     {0, 0, 0, 0}};
+// Extra (long-only) options are numbered from here on
+#define EXTRA_OPT_BASE 256
 
-// TODO: generate help
+// TODO: generate help for the common options too
 noreturn void display_help(bool err, const char *appname,
-                           const char *address_str) {
-    fprintf(err ? stderr : stdout,
-            "Usage: %s [-h|--help] [-l|--loglevel LOGLEVEL] [-p|--port PORT] "
-            "[%s]\n",
-            appname, address_str);
+                           const char *address_str,
+                           const app_option_t *extra) {
+    FILE *f = err ? stderr : stdout;
+    fprintf(f,
+            "Usage: %s [-h|--help] [-l|--loglevel LOGLEVEL] [-p|--port PORT]",
+            appname);
+    for (const app_option_t *o = extra; o && o->name; ++o) {
+        if (o->metavar) {
+            fprintf(f, " [--%s %s]", o->name, o->metavar);
+        } else {
+            fprintf(f, " [--%s]", o->name);
+        }
+    }
+    fprintf(f, " [%s]\n", address_str);
+    for (const app_option_t *o = extra; o && o->name; ++o) {
+        if (o->help) {
+            fprintf(f, "  --%-22s %s\n", o->name, o->help);
+        }
+    }
     exit(err ? 1 : 0);
 }
 
+bool opt_parse_uint(const char *arg, void *dest) {
+    char *endptr;
+    errno = 0;
+    unsigned long v = strtoul(arg, &endptr, 10);
+    if (*arg == '\0' || *arg == '-' || *endptr != '\0' || errno != 0 ||
+        v > UINT32_MAX) {
+        fprintf(stderr, "Invalid unsigned integer: %s\n", arg);
+        return false;
+    }
+    *(uint32_t *)dest = v;
+    return true;
+}
+
+bool opt_parse_flag(const char *arg, void *dest) {
+    (void)arg;
+    *(bool *)dest = true;
+    return true;
+}
+
 void parse_args(int argc, char **argv, char *addr, size_t addr_len,
-                uint32_t *port, const char *appname, const char *addr_desc) {
+                uint32_t *port, const char *appname, const char *addr_desc,
+                const app_option_t *extra) {
     int c;
     bool error = true;
 
+    size_t extra_cnt = 0;
+    while (extra && extra[extra_cnt].name)
+        ++extra_cnt;
+    struct option *options =
+        xcalloc(ARRAY_SIZE(long_options) + extra_cnt, sizeof(*options));
+    memcpy(options, long_options, sizeof(long_options) - sizeof(*options));
+    for (size_t i = 0; i < extra_cnt; ++i) {
+        struct option *o = &options[ARRAY_SIZE(long_options) - 1 + i];
+        o->name = extra[i].name;
+        o->has_arg = extra[i].metavar ? required_argument : no_argument;
+        o->val = EXTRA_OPT_BASE + i;
+    }
+
     while (1) {
         int ind;
-        c = getopt_long(argc, argv, "h::l:p:", long_options, &ind);
+        c = getopt_long(argc, argv, "h::l:p:", options, &ind);
         if (c == -1)
             break;
 
@@ -59,8 +108,18 @@ void parse_args(int argc, char **argv, char *addr, size_t addr_len,
         case '?':
             goto help;
             break;
+        default:
+            if (c >= EXTRA_OPT_BASE && c < EXTRA_OPT_BASE + (int)extra_cnt) {
+                const app_option_t *o = &extra[c - EXTRA_OPT_BASE];
+                if (!o->parse(optarg, o->dest)) {
+                    fprintf(stderr, "Invalid value for --%s\n", o->name);
+                    goto help;
+                }
+            }
+            break;
         }
     }
+    free(options);
 
     bool got_addr = false;
     for (int i = optind; i < argc; ++i) {
@@ -79,5 +138,5 @@ void parse_args(int argc, char **argv, char *addr, size_t addr_len,
 
     return;
 help:
-    display_help(error, appname, addr_desc);
+    display_help(error, appname, addr_desc, extra);
 }
@@ -1,11 +1,20 @@
 #include "common.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-int recv_count(int fd, void *buf, size_t len, bool wait) {
-    char *p = buf;
+int send_count(int fd, const void *buf, size_t len) {
+    const char *p = buf;
     while (len) {
-        ssize_t cnt = recv(fd, p, len, wait ? 0 : MSG_DONTWAIT);
+        ssize_t cnt = send(fd, p, len, MSG_NOSIGNAL);
         if (cnt > 0) {
+            p += cnt;
             len -= cnt;
+        } else if (cnt == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                return -1;
+        } else if (cnt == -1 && errno == EINTR) {
+            continue;
         } else {
             return -1;
         }
@@ -34,6 +43,13 @@ int nick_cmp(const char *s, const char *t) {
     return strncasecmp(s, t, NICKNAME_LEN);
 }
 
+void nick_fold(char *key, const char *nickname) {
+    size_t i = 0;
+    for (; i < NICKNAME_LEN && nickname[i]; ++i)
+        key[i] = tolower((unsigned char)nickname[i]);
+    memset(key + i, 0, NICKNAME_LEN - i);
+}
+
 void *xmalloc(size_t sz) {
     sz = max_(sz, 1);
     void *p = malloc(sz);
@@ -50,3 +66,47 @@ void *xcalloc(size_t nmemb, size_t sz) {
         return p;
     ppanic("Memory allocation failed");
 }
+
+void *xcalloc_aligned(size_t align, size_t sz) {
+    // aligned_alloc() wants a multiple of the alignment
+    sz = (max_(sz, 1) + align - 1) / align * align;
+    void *p = aligned_alloc(align, sz);
+    if (p == NULL)
+        ppanic("Memory allocation failed");
+    memset(p, 0, sz);
+    return p;
+}
+
+void futex_wait(atomic_uint *addr, unsigned val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+void futex_wait_for(atomic_uint *addr, unsigned val, long timeout_ns) {
+    struct timespec ts = {timeout_ns / 1000000000, timeout_ns % 1000000000};
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+void futex_wake(atomic_uint *addr, int cnt) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, cnt, NULL, NULL, 0);
+}
+
+static size_t thread_stack_size = 0;
+
+void set_thread_stack_size(size_t sz) { thread_stack_size = sz; }
+
+void xthread_create(void *(*fn)(void *), void *arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = 0;
+    if (thread_stack_size)
+        err = pthread_attr_setstacksize(&attr, thread_stack_size);
+    pthread_t p;
+    if (err == 0)
+        err = pthread_create(&p, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        ppanic("pthread_create()");
+    }
+}
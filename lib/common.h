@@ -5,9 +5,11 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <search.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -17,6 +19,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <time.h>
+#include <unistd.h>
 #define NICKNAME_LEN 32
 #define ADDR_MAX_LEN 128
 #define DEFAULT_PORT 22502
@@ -61,17 +64,50 @@ int parse_log_level(const char *);
 void set_loglevel(loglevel_t);
 // clang-format on
 
-typedef enum user_state_t { UOFFLINE = 0, UONLINE, UBATTLING } user_state_t;
+typedef enum user_state_t {
+    UOFFLINE = 0,
+    UONLINE,
+    UBATTLING,
+    // Only sent to subscribers: the user left the subscribed window
+    UHIDDEN
+} user_state_t;
+
+/* Orders in which a window of the roster can be subscribed to */
+typedef enum roster_order_t {
+    // Score descending, then nickname
+    RO_SCORE = 0,
+    RO_NAME,
+    RO_MAX
+} roster_order_t;
+
+/* Embedded in the items of a ranklist_t */
+typedef struct ranklist_node_t {
+    struct ranklist_node_t *left, *right, *parent;
+    // Nodes in this subtree, this one included
+    size_t size;
+    uint32_t prio;
+} ranklist_node_t;
 
 typedef struct user_info_t {
     char nickname[NICKNAME_LEN];
-    uint16_t id;
+    uint32_t id;
     int32_t score;
     user_state_t state;
 #ifdef __IS_SERVER
     int fd;
     uint32_t key;
-    uint16_t chid;
+    uint32_t chid;
+    // nick_fold() of nickname and its hash_nick_key(), set once on creation
+    char nick_key[NICKNAME_LEN];
+    uint64_t nick_hash;
+    // Position in the cached roster pages
+    size_t roster_slot;
+    // Place in the roster in each order, see roster_rank()
+    ranklist_node_t rank_node[RO_MAX];
+    // subs_epoch when the user last changed
+    uint64_t changed_at;
+    // Set if the client subscribes to a window of the roster
+    struct subscription_t *sub;
 #endif
 } user_info_t;
 
@@ -83,8 +119,8 @@ typedef enum challenge_state_t { ASKING, STARTED } challenge_state_t;
 
 typedef struct challenge_t {
     // User1 is the one who initiates the fighting
-    uint16_t id;
-    uint16_t user1, user2;
+    uint32_t id;
+    uint32_t user1, user2;
     // Expected next turn
     uint16_t turn_no;
     // Valid if turn_no > 1
@@ -92,20 +128,38 @@ typedef struct challenge_t {
     battle_act_t act1, act2;
     int32_t hp1, hp2, maxhp1, maxhp2;
     challenge_state_t state;
+    // Copied from the users when the battle starts, for the battle worker
+    struct conn_t *conn1, *conn2;
+    uint32_t key1, key2;
+    // Score changes, set by the battle worker when the battle ends
+    int32_t delta1, delta2;
 } challenge_t;
 #endif
 
+/* Every message kind and the name of its body; see msg_fields_* below */
+#define for_each_msg_kind(X)                                                   \
+    X(JOIN, join)                                                              \
+    X(JOIN_R, join_r)                                                          \
+    X(QUIT, quit)                                                              \
+    X(UCHANGE, uchange)                                                        \
+    X(CHALLENGE, challenge)                                                    \
+    X(CHALLENGE_R, challenge_r)                                                \
+    X(TURN, turn)                                                              \
+    X(TURN_R, turn_r)                                                          \
+    X(SENDMSG, sendmsg)                                                        \
+    X(SUBSCRIBE, subscribe)                                                    \
+    X(SUBSCRIBE_R, subscribe_r)                                                \
+    X(UCOUNT, ucount)                                                          \
+    X(LEADERBOARD, leaderboard)                                                \
+    X(LEADERBOARD_R, leaderboard_r)
 typedef enum msg_kind_t {
-    JOIN = 1,
-    JOIN_R,
-    QUIT,
-    UCHANGE,
-    CHALLENGE,
-    CHALLENGE_R,
-    TURN,
-    TURN_R,
-    SENDMSG,
+    // clang-format off
+    MSG_MIN = 0,
+#define define_msg_kind(KIND, _) KIND,
+    for_each_msg_kind(define_msg_kind)
+#undef define_msg_kind
     MSG_MAX
+    // clang-format on
 } msg_kind_t;
 
 typedef enum msg_err_t {
@@ -123,6 +177,8 @@ typedef enum msg_err_t {
     INVARG,
     REJECTED,
     CANCELLED,
+    THROTTLED,
+    UNSUPPORTED,
     ME_OTHER
 } msg_err_t;
 
@@ -152,37 +208,6 @@ inline const char *act_name(battle_act_t act) {
 
 const char *msg_strerror(msg_err_t);
 
-typedef struct msg_head_t {
-    uint16_t kind;
-    uint16_t body_len;
-} __attribute__((packed)) msg_head_t;
-
-typedef struct msg_join_t {
-    char nickname[NICKNAME_LEN];
-} __attribute__((packed)) msg_join_t;
-
-typedef struct msg_join_r_t {
-    char nickname[NICKNAME_LEN];
-    uint16_t error;
-    uint16_t id;
-    uint32_t key;
-} __attribute__((packed)) msg_join_r_t;
-
-typedef struct msg_quit_t {
-    uint32_t key;
-    uint16_t id;
-} __attribute__((packed)) msg_quit_t;
-
-typedef struct msg_uchange_t {
-    uint32_t count;
-    struct {
-        char nickname[NICKNAME_LEN];
-        uint16_t id;
-        uint16_t state;
-        int32_t score;
-    } users[UCHANGE_MAX_UCNT];
-} __attribute__((packed)) msg_uchange_t;
-
 typedef enum challenge_action_t {
     C_START,
     C_REJECT,
@@ -190,73 +215,204 @@ typedef enum challenge_action_t {
     C_CANCEL
 } challenge_action_t;
 
-typedef struct msg_challenge_t {
-    uint16_t id1, id2;
-    uint32_t key;
-    uint16_t chid;
-    int16_t action;
-} __attribute__((packed)) msg_challenge_t;
-
-typedef struct msg_challenge_r_t {
-    uint16_t error;
-    uint16_t id1, id2;
-    uint16_t chid;
-    uint8_t is_id1;
-} __attribute__((packed)) msg_challenge_r_t;
-
-typedef struct msg_turn_t {
-    uint16_t user;
-    uint16_t chid;
-    uint32_t key;
-    uint16_t turn_no;
-    uint16_t action;
-} __attribute__((packed)) msg_turn_t;
-
-typedef struct msg_turn_r_t {
-    uint16_t chid;
-    uint16_t turn_no;
-    uint16_t action1, action2;
-    uint16_t winner;
-    int32_t hp1, hp2, maxhp1, maxhp2;
-    uint8_t fin;
-} __attribute__((packed)) msg_turn_r_t;
-
-typedef struct msg_sendmsg_t {
-    uint16_t id;
-    uint32_t key;
-    char text[128];
-} __attribute__((packed)) msg_sendmsg_t;
+// Sizes UCHANGE and SENDMSG bodies to their content on the wire
+#define MSG_FEAT_COMPACT 1u
+// Roster updates are limited to a window chosen with SUBSCRIBE
+#define MSG_FEAT_SUBSCRIBE 2u
+// Ids take 32 bits on the wire
+#define MSG_FEAT_ID32 4u
+// LEADERBOARD is answered
+#define MSG_FEAT_LEADERBOARD 8u
+// Everything this build understands
+#define MSG_FEATURES                                                           \
+    (MSG_FEAT_COMPACT | MSG_FEAT_SUBSCRIBE | MSG_FEAT_ID32 |                   \
+     MSG_FEAT_LEADERBOARD)
+// Set in the kind of frames encoded with MSG_FEAT_ID32
+#define MSG_KIND_ID32 0x8000u
+// Most users in a subscribed window
+#define SUBSCRIBE_MAX_LIMIT 256
+// Most users in a LEADERBOARD_R
+#define LEADERBOARD_MAX_CNT 16
+
+/* Wire layouts. Each msg_fields_<name> lists the fields of msg_<name>_t in
+ * order, from which the struct and its codec in messages.c are generated:
+ *   INT(type, name)          integer of 1, 2 or 4 bytes, in network order
+ *   STR(name, len)           NUL-terminated string in a fixed-size buffer
+ *   ARR(elem, name, max, n)  up to max msg_<elem>_t's; field n is the count
+ *   VSTR(name, len)          like STR, but sent without the padding
+ *   EXT(type, name)          INT added later; only sent to clients that
+ *                            announce any MSG_FEAT_*
+ *   ID(name)                 user or challenge id; 32 bits in frames marked
+ *                            with MSG_KIND_ID32, 16 bits otherwise
+ *   HOST(type, name)         INT that the original protocol sent in the
+ *                            sender's byte order; in network order only in
+ *                            frames marked with MSG_KIND_ID32
+ * In compact form ARR only carries n elements. ARR, VSTR and EXT may only
+ * come last. */
+// clang-format off
+#define msg_fields_head(INT, STR, ARR, VSTR, EXT, ID, HOST)                    \
+    INT(uint16_t, kind)                                                        \
+    INT(uint16_t, body_len)
+#define msg_fields_join(INT, STR, ARR, VSTR, EXT, ID, HOST)                    \
+    STR(nickname, NICKNAME_LEN)                                                \
+    /* MSG_FEAT_* understood by the client */                                  \
+    EXT(uint32_t, features)
+#define msg_fields_join_r(INT, STR, ARR, VSTR, EXT, ID, HOST)                  \
+    STR(nickname, NICKNAME_LEN)                                                \
+    INT(uint16_t, error)                                                       \
+    ID(id)                                                                     \
+    INT(uint32_t, key)                                                         \
+    /* MSG_FEAT_* accepted by the server */                                    \
+    EXT(uint32_t, features)
+#define msg_fields_quit(INT, STR, ARR, VSTR, EXT, ID, HOST)                    \
+    INT(uint32_t, key)                                                         \
+    ID(id)
+#define msg_fields_uchange_user(INT, STR, ARR, VSTR, EXT, ID, HOST)            \
+    STR(nickname, NICKNAME_LEN)                                                \
+    ID(id)                                                                     \
+    INT(uint16_t, state)                                                       \
+    HOST(int32_t, score)
+#define msg_fields_uchange(INT, STR, ARR, VSTR, EXT, ID, HOST)                 \
+    INT(uint32_t, count)                                                       \
+    ARR(uchange_user, users, UCHANGE_MAX_UCNT, count)
+#define msg_fields_challenge(INT, STR, ARR, VSTR, EXT, ID, HOST)               \
+    ID(id1)                                                                    \
+    ID(id2)                                                                    \
+    INT(uint32_t, key)                                                         \
+    ID(chid)                                                                   \
+    INT(int16_t, action)
+#define msg_fields_challenge_r(INT, STR, ARR, VSTR, EXT, ID, HOST)             \
+    INT(uint16_t, error)                                                       \
+    ID(id1)                                                                    \
+    ID(id2)                                                                    \
+    ID(chid)                                                                   \
+    INT(uint8_t, is_id1)
+#define msg_fields_turn(INT, STR, ARR, VSTR, EXT, ID, HOST)                    \
+    ID(user)                                                                   \
+    ID(chid)                                                                   \
+    INT(uint32_t, key)                                                         \
+    INT(uint16_t, turn_no)                                                     \
+    INT(uint16_t, action)
+#define msg_fields_turn_r(INT, STR, ARR, VSTR, EXT, ID, HOST)                  \
+    ID(chid)                                                                   \
+    INT(uint16_t, turn_no)                                                     \
+    INT(uint16_t, action1)                                                     \
+    INT(uint16_t, action2)                                                     \
+    ID(winner)                                                                 \
+    INT(int32_t, hp1)                                                          \
+    INT(int32_t, hp2)                                                          \
+    INT(int32_t, maxhp1)                                                       \
+    INT(int32_t, maxhp2)                                                       \
+    INT(uint8_t, fin)
+#define msg_fields_sendmsg(INT, STR, ARR, VSTR, EXT, ID, HOST)                 \
+    ID(id)                                                                     \
+    INT(uint32_t, key)                                                         \
+    VSTR(text, 128)
+/* Asks for updates on the users ranked [offset, offset + limit) in order,
+ * besides the subscriber and its opponent. Answered by SUBSCRIBE_R, which
+ * replaces whatever the client was sent before, and the users in the window
+ * as UCHANGE's. Users leaving the window are sent as UHIDDEN; UCOUNT follows
+ * changes of the user count. */
+#define msg_fields_subscribe(INT, STR, ARR, VSTR, EXT, ID, HOST)               \
+    ID(id)                                                                     \
+    INT(uint32_t, key)                                                         \
+    INT(uint16_t, order)                                                       \
+    INT(uint32_t, offset)                                                      \
+    INT(uint16_t, limit)
+#define msg_fields_subscribe_r(INT, STR, ARR, VSTR, EXT, ID, HOST)             \
+    INT(uint16_t, error)                                                       \
+    INT(uint16_t, order)                                                       \
+    INT(uint32_t, offset)                                                      \
+    INT(uint16_t, limit)                                                       \
+    INT(uint32_t, total)
+#define msg_fields_ucount(INT, STR, ARR, VSTR, EXT, ID, HOST)                  \
+    INT(uint32_t, total)
+/* Asks for the users ranked [offset, offset + limit) by score and for the
+ * rank of the sender. Answered by LEADERBOARD_R, whose rank is 1-based. */
+#define msg_fields_leaderboard(INT, STR, ARR, VSTR, EXT, ID, HOST)             \
+    ID(id)                                                                     \
+    INT(uint32_t, key)                                                         \
+    INT(uint32_t, offset)                                                      \
+    INT(uint16_t, limit)
+#define msg_fields_leaderboard_r(INT, STR, ARR, VSTR, EXT, ID, HOST)           \
+    INT(uint16_t, error)                                                       \
+    INT(uint32_t, rank)                                                        \
+    INT(uint32_t, total)                                                       \
+    INT(uint32_t, offset)                                                      \
+    INT(uint32_t, count)                                                       \
+    ARR(uchange_user, users, LEADERBOARD_MAX_CNT, count)
+
+#define msg_struct_int(type, name) type name;
+#define msg_struct_str(name, len) char name[len];
+#define msg_struct_arr(elem, name, max, _) msg_##elem##_t name[max];
+#define msg_struct_id(name) uint32_t name;
+#define define_msg_struct(name)                                                \
+    typedef struct msg_##name##_t {                                            \
+        msg_fields_##name(msg_struct_int, msg_struct_str, msg_struct_arr,      \
+                          msg_struct_str, msg_struct_int, msg_struct_id,       \
+                          msg_struct_int)                                      \
+    } __attribute__((packed)) msg_##name##_t;
+#define define_msg_body_struct(_, name) define_msg_struct(name)
+define_msg_struct(head)
+define_msg_struct(uchange_user)
+for_each_msg_kind(define_msg_body_struct)
 
 typedef union msg_body_t {
-    msg_join_t join;
-    msg_join_r_t join_r;
-    msg_quit_t quit;
-    msg_uchange_t uchange;
-    msg_challenge_t challenge;
-    msg_challenge_r_t challenge_r;
-    msg_turn_t turn;
-    msg_turn_r_t turn_r;
-    msg_sendmsg_t sendmsg;
+#define define_msg_body_member(_, name) msg_##name##_t name;
+    for_each_msg_kind(define_msg_body_member)
+#undef define_msg_body_member
 } __attribute__((packed)) msg_body_t;
+// clang-format on
 
 typedef struct message_t {
     msg_head_t head;
     msg_body_t body;
 } __attribute__((packed)) message_t;
 
-int recv_count(int fd, void *buf, size_t len, bool wait);
-int msg_check_form(const struct message_t *buf);
-int msg_recv(int fd, struct message_t *buf, bool block_at_head);
-/* buf should be in host byte order. */
-int msg_send(int fd, const message_t *buf);
+/* Sends all len bytes, waiting for writability if fd is non-blocking. */
+int send_count(int fd, const void *buf, size_t len);
+/* Converts a received head to host byte order in place and checks it. The
+ * kind keeps MSG_KIND_ID32 until the body is decoded. */
+int msg_head_decode(msg_head_t *head);
+/* buf should be in host byte order. features are the MSG_FEAT_* of the
+ * receiver. */
+int msg_send(int fd, const message_t *buf, uint32_t features);
+/* Encoded size of buf in the form the receiver's features ask for, or 0 if
+ * buf is invalid. */
+size_t msg_wire_size(const message_t *buf, uint32_t features);
+/* Writes buf in network byte order to out, which must hold
+ * msg_wire_size(buf, features) bytes. Returns the encoded size, or 0 if buf
+ * is invalid. */
+size_t msg_encode(const message_t *buf, void *out, uint32_t features);
+
+/* Buffers a stream so that each recv() can yield many frames */
+#define FRAME_READER_CAP (2 * sizeof(message_t))
+typedef struct frame_reader_t {
+    // Bytes in [start, len) of data are not parsed yet
+    size_t start, len;
+    char data[FRAME_READER_CAP];
+} frame_reader_t;
+void frame_reader_init(frame_reader_t *fr);
+/* Where to receive into next; *room is never 0. */
+void *frame_reader_space(frame_reader_t *fr, size_t *room);
+/* Accounts for cnt bytes received at frame_reader_space(). */
+void frame_reader_filled(frame_reader_t *fr, size_t cnt);
+/* Decodes the next complete frame into buf. Returns 1 if a frame was decoded,
+ * 0 if more bytes are needed and -1 if the stream is corrupted. */
+int frame_reader_next(frame_reader_t *fr, struct message_t *buf);
+/* A single recv() into fr. Returns like recv(). */
+ssize_t frame_reader_recv(frame_reader_t *fr, int fd, int flags);
 
 /* Initializes the head. Zero-initializes the body. */
 void init_msg_buf(message_t *, msg_kind_t);
-/* Initializes the head. Zero-initializes the body. */
+/* Initializes the head. Zero-initializes the body. The message_t's returned
+ * by make_msg_buf(), msg_dup() and make_*() only have room for the body of
+ * their kind and must be freed with msg_free(). */
 message_t *make_msg_buf(msg_kind_t);
 message_t *msg_dup(const message_t *);
+void msg_free(message_t *);
 message_t *make_join(const char *nickname);
-message_t *make_join_r(const char *nickname, uint16_t error, uint16_t id,
+message_t *make_join_r(const char *nickname, uint16_t error, uint32_t id,
                        uint32_t key);
 message_t *make_uchange();
 /* Returns false if original msg was full, and in this case it stores pointer to
@@ -264,7 +420,7 @@ message_t *make_uchange();
  * otherwise
  */
 bool uchange_add_or_create(message_t *msg, message_t **newmsg,
-                           const char *nickname, uint16_t id,
+                           const char *nickname, uint32_t id,
                            user_state_t state, int32_t score);
 message_t *make_challenge();
 message_t *make_challenge_r();
@@ -278,10 +434,161 @@ queue_err_t queue_add(queue_t *, void *, bool block);
 queue_err_t queue_take(queue_t *, void **, bool block);
 void queue_destroy(queue_t *);
 
+/* Bounded lock-free queue for many producers and a single consumer. Adding
+ * and taking never lock; a thread only sleeps (on a futex) when it must wait
+ * for an entry or for room. */
+typedef struct mpsc_queue_t mpsc_queue_t;
+/* cap is rounded up to a power of two. */
+mpsc_queue_t *mpsc_create(size_t cap);
+queue_err_t mpsc_add(mpsc_queue_t *, void *, bool block);
+/* Moves up to max entries to out and returns how many. If block, waits until
+ * there is at least one. Only one thread may take. */
+size_t mpsc_take_batch(mpsc_queue_t *, void **out, size_t max, bool block);
+/* Like mpsc_take_batch() with block, but waits at most timeout_ns
+ * nanoseconds and may return 0. */
+size_t mpsc_take_batch_for(mpsc_queue_t *, void **out, size_t max,
+                           long timeout_ns);
+void mpsc_destroy(mpsc_queue_t *);
+
+/* Bounded ring for exactly one producer and one consumer. The try_ calls are
+ * wait-free; the others sleep on a futex while the ring is full or empty. */
+typedef struct spsc_ring_t spsc_ring_t;
+/* cap is rounded up to a power of two. */
+spsc_ring_t *spsc_create(size_t cap);
+/* Returns false if the ring is full. */
+bool spsc_try_add(spsc_ring_t *, void *);
+void spsc_add(spsc_ring_t *, void *);
+/* Like spsc_add(), but the consumer only sees e, and is only woken, once
+ * spsc_publish() is called. */
+void spsc_stage(spsc_ring_t *, void *);
+void spsc_publish(spsc_ring_t *);
+/* Moves up to max entries to out and returns how many. */
+size_t spsc_try_take_batch(spsc_ring_t *, void **out, size_t max);
+/* Like spsc_try_take_batch(), but waits for at least one entry. */
+size_t spsc_take_batch(spsc_ring_t *, void **out, size_t max);
+void spsc_destroy(spsc_ring_t *);
+
+/* Work-stealing scheduler. Each worker thread runs the tasks it spawned
+ * itself first and steals from a random other worker when it has none left;
+ * tasks spawned from other threads are shared by all workers. */
+typedef struct sched_task_t {
+    void (*fn)(void *arg);
+    void *arg;
+    _Atomic(struct sched_task_t *) next;
+} sched_task_t;
+typedef struct sched_t sched_t;
+/* Starts the workers. idle, if set, is called by a worker before it looks
+ * for more tasks to run, after it ran out of them or ran a number of them. */
+sched_t *sched_create(unsigned workers, void (*idle)(void));
+/* Runs fn(arg) on some worker. Any thread may spawn, and it never blocks. */
+void sched_spawn(sched_t *, void (*fn)(void *), void *arg);
+
+/* Tasks posted to a strand run one at a time and in the order posted, on
+ * whichever worker is free; different strands run in parallel. */
+typedef struct strand_t {
+    sched_t *sched;
+    _Atomic(sched_task_t *) tail;
+    // Only touched by the task running the strand
+    sched_task_t *head;
+    sched_task_t stub;
+    atomic_size_t pending;
+} strand_t;
+void strand_init(strand_t *, sched_t *);
+/* Any thread may post, and it never blocks. */
+void strand_post(strand_t *, void (*fn)(void *), void *arg);
+
+/* Epoch-based reclamation. Between epoch_enter() and epoch_leave(), a reader
+ * may use anything it loaded from a published pointer, however the writer
+ * replaces it meanwhile; the writer hands what it unpublished to
+ * epoch_retire(), which frees it once every reader that could have seen it
+ * has left. Readers never block the writer. Only one thread may retire. */
+void epoch_enter(void);
+void epoch_leave(void);
+/* Calls free_fn(p) once no reader can hold p any more. */
+void epoch_retire(void (*free_fn)(void *), void *p);
+/* Frees what was retired as far as readers allow. Returns true if readers
+ * still hold some of it. */
+bool epoch_reclaim(void);
+
+/* Allocator of fixed-size objects. Each thread caches free objects, so that
+ * most calls take no lock; an object may be freed by another thread than the
+ * one that allocated it. Memory is never returned to the heap. */
+typedef struct pool_t {
+    const char *name;
+    size_t size;
+    // Position in the per-thread caches plus one, 0 until first used
+    atomic_uint idx;
+    pthread_mutex_t lock;
+    void *free;
+    // Objects in use, the most ever in use, and all taken from the heap
+    atomic_size_t live, peak, reserved;
+} pool_t;
+#define POOL_INITIALIZER_SIZE(name_, size_)                                    \
+    { .name = (name_), .size = (size_), .lock = PTHREAD_MUTEX_INITIALIZER }
+#define POOL_INITIALIZER(name_, type_) POOL_INITIALIZER_SIZE(name_, sizeof(type_))
+void *pool_alloc(pool_t *pool);
+/* Like pool_alloc(), but zeroes the object. */
+void *pool_calloc(pool_t *pool);
+void pool_free(pool_t *pool, void *p);
+/* Logs the counters of every pool used so far. */
+void pool_log_stats(void);
+
+/* Open-addressing hash table of pointers to items that hold their own keys.
+ * items[0, cnt) may be scanned directly; inserting or removing an item may
+ * move the others. */
+typedef struct hashtab_t {
+    void **items;
+    size_t cnt;
+    struct hashtab_slot_t *index;
+    size_t mask;
+    uint64_t (*hash)(const void *item);
+    bool (*eq)(const void *item, const void *other);
+} hashtab_t;
+void hashtab_init(hashtab_t *ht, uint64_t (*hash)(const void *),
+                  bool (*eq)(const void *, const void *));
+void hashtab_destroy(hashtab_t *ht);
+/* Returns the item equal to key, or NULL. */
+void *hashtab_find(const hashtab_t *ht, const void *key);
+/* Adds item unless an equal one is there; returns the item in the table. */
+void *hashtab_insert(hashtab_t *ht, void *item);
+/* Removes the item equal to key and returns it, or NULL if there is none. */
+void *hashtab_remove(hashtab_t *ht, const void *key);
+uint64_t hash_u64(uint64_t);
+/* Hashes the NICKNAME_LEN bytes written by nick_fold() */
+uint64_t hash_nick_key(const char *key);
+
+/* Sorted list of items that embed a ranklist_node_t, which finds the rank of
+ * an item and the item at a rank in O(log n) expected time. */
+typedef struct ranklist_t {
+    ranklist_node_t *root;
+    int (*cmp)(const ranklist_node_t *, const ranklist_node_t *, void *arg);
+    void *arg;
+    uint32_t seed;
+} ranklist_t;
+void ranklist_init(ranklist_t *list,
+                   int (*cmp)(const ranklist_node_t *, const ranklist_node_t *,
+                              void *),
+                   void *arg);
+void ranklist_insert(ranklist_t *list, ranklist_node_t *node);
+/* Only needs node to be in list, not to be in order: an item whose key
+ * changed is removed and inserted again. */
+void ranklist_remove(ranklist_t *list, ranklist_node_t *node);
+size_t ranklist_size(const ranklist_t *list);
+/* How many nodes go before node */
+size_t ranklist_rank(const ranklist_node_t *node);
+/* The node with rank rank, or NULL */
+ranklist_node_t *ranklist_at(const ranklist_t *list, size_t rank);
+/* Neighbours of node in order, or NULL */
+ranklist_node_t *ranklist_next(const ranklist_node_t *node);
+ranklist_node_t *ranklist_prev(const ranklist_node_t *node);
+
 bool null_terminated(const char *str, size_t maxlen);
 bool is_nickchar(char);
 bool is_nickstr(const char *);
 int nick_cmp(const char *, const char *);
+/* Writes the NICKNAME_LEN-byte key of nickname: lower case and padded with
+ * zeros, so that memcmp() of two keys agrees with nick_cmp(). */
+void nick_fold(char *key, const char *nickname);
 
 static inline int cmp_by_id(const void *u, const void *v) {
     const user_info_t *uu = u, *uv = v;
@@ -291,22 +598,63 @@ static inline int cmp_by_nick(const void *u, const void *v) {
     const user_info_t *uu = u, *uv = v;
     return nick_cmp(uu->nickname, uv->nickname);
 }
+static inline uint64_t hash_by_id(const void *u) {
+    return hash_u64(((const user_info_t *)u)->id);
+}
+static inline bool eq_by_id(const void *u, const void *v) {
+    return ((const user_info_t *)u)->id == ((const user_info_t *)v)->id;
+}
 #ifdef __IS_SERVER
-static inline int cmp_by_fd(const void *u, const void *v) {
-    const user_info_t *uu = u, *uv = v;
-    return (uu->fd > uv->fd) - (uu->fd < uv->fd);
+static inline uint64_t hash_by_nick(const void *u) {
+    return ((const user_info_t *)u)->nick_hash;
+}
+static inline bool eq_by_nick(const void *u, const void *v) {
+    return memcmp(((const user_info_t *)u)->nick_key,
+                  ((const user_info_t *)v)->nick_key, NICKNAME_LEN) == 0;
+}
+static inline uint64_t hash_by_chid(const void *c) {
+    return hash_u64(((const challenge_t *)c)->id);
 }
-static inline int cmp_by_chid(const void *c, const void *d) {
-    const challenge_t *cc = c, *dd = d;
-    return (cc->id > dd->id) - (cc->id < dd->id);
+static inline bool eq_by_chid(const void *c, const void *d) {
+    return ((const challenge_t *)c)->id == ((const challenge_t *)d)->id;
 }
 #endif
 
 void *xmalloc(size_t sz);
 void *xcalloc(size_t nmemb, size_t sz);
+/* Zero-filled sz bytes aligned to align, a power of two. */
+void *xcalloc_aligned(size_t align, size_t sz);
+/* Sleeps while *addr == val. May return spuriously; callers check again. */
+void futex_wait(atomic_uint *addr, unsigned val);
+/* Like futex_wait(), but returns after timeout_ns nanoseconds at the latest. */
+void futex_wait_for(atomic_uint *addr, unsigned val, long timeout_ns);
+/* Wakes up to cnt threads sleeping on addr. */
+void futex_wake(atomic_uint *addr, int cnt);
+/* Stack size of the threads started by xthread_create() from now on; 0 is
+ * the system default. */
+void set_thread_stack_size(size_t sz);
+/* Starts fn(arg) on a detached thread, whose resources go back to the system
+ * as soon as it returns. */
+void xthread_create(void *(*fn)(void *), void *arg);
+
+/* Application-specific long option. Arrays of these are terminated by an
+ * entry whose name is NULL. Options with a NULL metavar take no argument. */
+typedef struct app_option_t {
+    const char *name;
+    const char *metavar;
+    const char *help;
+    /* Returns false if arg is invalid */
+    bool (*parse)(const char *arg, void *dest);
+    void *dest;
+} app_option_t;
+/* dest is a uint32_t */
+bool opt_parse_uint(const char *arg, void *dest);
+/* dest is a bool */
+bool opt_parse_flag(const char *arg, void *dest);
 
 noreturn void display_help(bool err, const char *appname,
-                           const char *address_str);
+                           const char *address_str, const app_option_t *extra);
 void parse_args(int argc, char **argv, char *addr, size_t addr_len,
-                uint32_t *port, const char *appname, const char *addr_desc);
+                uint32_t *port, const char *appname, const char *addr_desc,
+                const app_option_t *extra);
 #endif
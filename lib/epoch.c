@@ -0,0 +1,87 @@
+#include "common.h"
+
+// Threads that may ever read
+#define MAX_READERS 64
+
+/* The global epoch only moves from e to e + 1 once every reader inside has
+ * entered during e. A reader can therefore hold something retired during e
+ * until the epoch reaches e + 2, and no longer. */
+typedef struct epoch_reader_t {
+    // The epoch the reader entered in, or 0 outside
+    _Alignas(64) atomic_ulong epoch;
+} epoch_reader_t;
+
+typedef struct epoch_retired_t {
+    void (*free_fn)(void *);
+    void *p;
+    unsigned long epoch;
+} epoch_retired_t;
+
+static _Alignas(64) atomic_ulong global_epoch = 1;
+static epoch_reader_t readers[MAX_READERS];
+static atomic_uint reader_cnt;
+static _Thread_local epoch_reader_t *self = NULL;
+
+// Only touched by the writer, oldest first
+static epoch_retired_t *retired = NULL;
+static size_t retired_cnt = 0, retired_cap = 0;
+
+void epoch_enter() {
+    if (self == NULL) {
+        unsigned idx = atomic_fetch_add(&reader_cnt, 1);
+        if (idx >= MAX_READERS)
+            panic("Too many epoch readers");
+        self = &readers[idx];
+    }
+    atomic_store_explicit(&self->epoch, atomic_load(&global_epoch),
+                          memory_order_relaxed);
+    // Pairs with the fence in epoch_advance(): either the writer sees us
+    // inside, or our loads below see what it published before advancing
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_leave() {
+    atomic_store_explicit(&self->epoch, 0, memory_order_release);
+}
+
+static unsigned long epoch_advance() {
+    unsigned long e = atomic_load(&global_epoch);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned cnt = min_(atomic_load(&reader_cnt), MAX_READERS);
+    for (unsigned i = 0; i < cnt; ++i) {
+        unsigned long r =
+            atomic_load_explicit(&readers[i].epoch, memory_order_acquire);
+        if (r && r != e)
+            return e;
+    }
+    atomic_store(&global_epoch, e + 1);
+    return e + 1;
+}
+
+void epoch_retire(void (*free_fn)(void *), void *p) {
+    if (retired_cnt == retired_cap) {
+        retired_cap = max_(retired_cap * 2, 64);
+        retired = realloc(retired, retired_cap * sizeof(*retired));
+        if (retired == NULL)
+            ppanic("Memory allocation failed");
+    }
+    retired[retired_cnt++] = (epoch_retired_t){
+        .free_fn = free_fn, .p = p, .epoch = atomic_load(&global_epoch)};
+}
+
+bool epoch_reclaim() {
+    if (retired_cnt == 0)
+        return false;
+    // The oldest may need the epoch to move twice
+    unsigned long e = atomic_load(&global_epoch);
+    for (int i = 0; i < 2 && retired[0].epoch + 2 > e; ++i)
+        e = epoch_advance();
+    size_t n = 0;
+    while (n < retired_cnt && retired[n].epoch + 2 <= e) {
+        retired[n].free_fn(retired[n].p);
+        ++n;
+    }
+    memmove(retired, retired + n, (retired_cnt - n) * sizeof(*retired));
+    retired_cnt -= n;
+    return retired_cnt > 0;
+}
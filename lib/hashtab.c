@@ -0,0 +1,131 @@
+#include "common.h"
+
+/* A slot of the index: the position of an item plus one (0 if the slot is
+ * empty) and the low bits of its hash, which spare most calls to eq */
+typedef struct hashtab_slot_t {
+    uint32_t pos;
+    uint32_t hash;
+} hashtab_slot_t;
+
+uint64_t hash_u64(uint64_t x) {
+    // The finalizer of MurmurHash3
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+uint64_t hash_nick_key(const char *key) {
+    // Keys are padded, so they are hashed a word at a time
+    static_assert(NICKNAME_LEN % sizeof(uint64_t) == 0, "");
+    uint64_t h = 0;
+    for (size_t i = 0; i < NICKNAME_LEN; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, key + i, sizeof(w));
+        h = hash_u64(h ^ w);
+    }
+    return h;
+}
+
+void hashtab_init(hashtab_t *ht, uint64_t (*hash)(const void *),
+                  bool (*eq)(const void *, const void *)) {
+    memset(ht, 0, sizeof(*ht));
+    ht->hash = hash;
+    ht->eq = eq;
+}
+
+void hashtab_destroy(hashtab_t *ht) {
+    free(ht->items);
+    free(ht->index);
+    hashtab_init(ht, ht->hash, ht->eq);
+}
+
+/* The slot holding an item equal to key, or the empty slot ending its probe
+ * sequence */
+static size_t hashtab_probe(const hashtab_t *ht, const void *key,
+                            uint32_t hash) {
+    size_t i = hash & ht->mask;
+    for (;; i = (i + 1) & ht->mask) {
+        const hashtab_slot_t *s = &ht->index[i];
+        if (s->pos == 0 ||
+            (s->hash == hash && ht->eq(ht->items[s->pos - 1], key))) {
+            return i;
+        }
+    }
+}
+
+static void hashtab_grow(hashtab_t *ht) {
+    size_t cap = max_((ht->mask + 1) * 2, 16);
+    free(ht->index);
+    ht->index = xcalloc(cap, sizeof(*ht->index));
+    ht->mask = cap - 1;
+    for (size_t p = 0; p < ht->cnt; ++p) {
+        uint32_t hash = ht->hash(ht->items[p]);
+        size_t i = hash & ht->mask;
+        while (ht->index[i].pos)
+            i = (i + 1) & ht->mask;
+        ht->index[i] = (hashtab_slot_t){.pos = p + 1, .hash = hash};
+    }
+    ht->items = realloc(ht->items, cap * sizeof(*ht->items));
+    if (ht->items == NULL)
+        ppanic("Memory allocation failed");
+}
+
+void *hashtab_find(const hashtab_t *ht, const void *key) {
+    if (ht->cnt == 0)
+        return NULL;
+    size_t i = hashtab_probe(ht, key, ht->hash(key));
+    return ht->index[i].pos ? ht->items[ht->index[i].pos - 1] : NULL;
+}
+
+void *hashtab_insert(hashtab_t *ht, void *item) {
+    // At most 3/4 full, which keeps probe sequences short
+    if ((ht->cnt + 1) * 4 > (ht->mask + 1) * 3)
+        hashtab_grow(ht);
+    uint32_t hash = ht->hash(item);
+    size_t i = hashtab_probe(ht, item, hash);
+    if (ht->index[i].pos)
+        return ht->items[ht->index[i].pos - 1];
+    ht->items[ht->cnt++] = item;
+    ht->index[i] = (hashtab_slot_t){.pos = ht->cnt, .hash = hash};
+    return item;
+}
+
+/* Empties slot i, moving later entries of the same probe sequences back so
+ * that lookups need no tombstones */
+static void hashtab_unlink(hashtab_t *ht, size_t i) {
+    for (size_t j = (i + 1) & ht->mask; ht->index[j].pos;
+         j = (j + 1) & ht->mask) {
+        size_t home = ht->index[j].hash & ht->mask;
+        // Whether home lies cyclically in (i, j]
+        bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            ht->index[i] = ht->index[j];
+            i = j;
+        }
+    }
+    ht->index[i].pos = 0;
+}
+
+void *hashtab_remove(hashtab_t *ht, const void *key) {
+    if (ht->cnt == 0)
+        return NULL;
+    size_t i = hashtab_probe(ht, key, ht->hash(key));
+    if (ht->index[i].pos == 0)
+        return NULL;
+    size_t pos = ht->index[i].pos - 1;
+    void *item = ht->items[pos];
+    hashtab_unlink(ht, i);
+    // The last item fills the gap, keeping items dense
+    if (pos != --ht->cnt) {
+        void *last = ht->items[ht->cnt];
+        size_t j = ht->hash(last) & ht->mask;
+        while (ht->index[j].pos != ht->cnt + 1)
+            j = (j + 1) & ht->mask;
+        ht->index[j].pos = pos + 1;
+        ht->items[pos] = last;
+    }
+    return item;
+}
@@ -1,101 +1,205 @@
 #include "common.h"
 
-#define check_nt(pmsg, var, fld)                                               \
-    do {                                                                       \
-        if (!null_terminated((pmsg)->body.var.fld,                             \
-                             sizeof((pmsg)->body.var.fld)))                    \
+/* Integers of sz bytes in network byte order; these become a single bswap
+ * on little-endian hosts */
+static inline uint32_t get_be(const char *p, size_t sz) {
+    switch (sz) {
+    case 1:
+        return (uint8_t)*p;
+    case 2: {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return ntohs(v);
+    }
+    default: {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return ntohl(v);
+    }
+    }
+}
+
+static inline void put_be(char *p, uint32_t v, size_t sz) {
+    switch (sz) {
+    case 1:
+        *p = (char)v;
+        break;
+    case 2: {
+        uint16_t n = htons(v);
+        memcpy(p, &n, sizeof(n));
+    } break;
+    default: {
+        uint32_t n = htonl(v);
+        memcpy(p, &n, sizeof(n));
+    } break;
+    }
+}
+
+#define is_compact (features & MSG_FEAT_COMPACT)
+#define id_size (features & MSG_FEAT_ID32 ? 4 : 2)
+#define vstr_len(str, len) min_(strnlen((str), (len)) + 1, (size_t)(len))
+
+/* msg_check_<name>(src): validates a message in host byte order */
+#define chk_int(type, name)                                                    \
+    static_assert(sizeof(type) == 1 || sizeof(type) == 2 ||                   \
+                      sizeof(type) == 4,                                       \
+                  "Integer fields must be 1, 2 or 4 bytes long");
+#define chk_str(name, len)                                                     \
+    if (!null_terminated(src->name, (len)))                                    \
+        return -1;
+#define chk_arr(elem, name, max, n)                                            \
+    if (src->n > (max))                                                        \
+        return -1;                                                             \
+    for (size_t i = 0; i < src->n; ++i) {                                      \
+        if (msg_check_##elem(&src->name[i]) != 0)                              \
             return -1;                                                         \
-    } while (0)
-#define conv(fld)                                                              \
-    do {                                                                       \
-        static_assert(sizeof(fld) == 1 || sizeof(fld) == 2 ||                  \
-                          sizeof(fld) == 4,                                    \
-                      "Field to convert must be 1, 2 or 4 bytes long");        \
-        if (sizeof(fld) == 1) {                                                \
-            ;                                                                  \
-        } else if (sizeof(fld) == 2) {                                         \
-            if (l2n) {                                                         \
-                fld = htons(fld);                                              \
-            } else {                                                           \
-                fld = ntohs(fld);                                              \
-            }                                                                  \
-        } else if (sizeof(fld) == 4) {                                         \
-            if (l2n) {                                                         \
-                fld = htonl(fld);                                              \
-            } else {                                                           \
-                fld = ntohl(fld);                                              \
-            }                                                                  \
+    }
+#define chk_id(name)
+
+/* msg_wire_size_<name>(src, features): encoded size */
+#define size_int(type, name) sz += sizeof(type);
+#define size_str(name, len) sz += (len);
+#define size_arr(elem, name, max, n)                                           \
+    sz += (is_compact ? min_(src->n, (max)) : (max)) *                         \
+          msg_wire_size_##elem(NULL, features);
+#define size_vstr(name, len)                                                   \
+    sz += is_compact ? vstr_len(src->name, (len)) : (len);
+#define size_ext(type, name)                                                   \
+    if (features)                                                              \
+        sz += sizeof(type);
+#define size_id(name) sz += id_size;
+
+/* msg_encode_<name>(src, out, features): returns the encoded size */
+#define enc_int(type, name)                                                    \
+    put_be(out + off, (uint32_t)src->name, sizeof(type));                      \
+    off += sizeof(type);
+#define enc_str(name, len)                                                     \
+    memcpy(out + off, src->name, (len));                                       \
+    off += (len);
+#define enc_arr(elem, name, max, n)                                            \
+    {                                                                          \
+        size_t cnt = min_(src->n, (max));                                      \
+        for (size_t i = 0; i < cnt; ++i)                                       \
+            off += msg_encode_##elem(&src->name[i], out + off, features);      \
+        if (!is_compact) {                                                     \
+            size_t pad = ((max)-cnt) * msg_wire_size_##elem(NULL, features);   \
+            memset(out + off, 0, pad);                                         \
+            off += pad;                                                        \
         }                                                                      \
-    } while (0)
-#define msg_body_conv                                                          \
-    do {                                                                       \
-        switch (kind) {                                                        \
-        case JOIN:                                                             \
-            break;                                                             \
-        case JOIN_R:                                                           \
-            conv(body->join_r.error);                                          \
-            conv(body->join_r.id);                                             \
-            conv(body->join_r.key);                                            \
-            break;                                                             \
-        case QUIT:                                                             \
-            conv(body->quit.id);                                               \
-            conv(body->quit.key);                                              \
-            break;                                                             \
-        case UCHANGE:                                                          \
-            conv(body->uchange.count);                                         \
-            for (size_t i = 0;                                                 \
-                 i < body->uchange.count && i < UCHANGE_MAX_UCNT; ++i) {       \
-                conv(body->uchange.users[i].id);                               \
-                conv(body->uchange.users[i].state);                            \
-            }                                                                  \
-            break;                                                             \
-        case CHALLENGE:                                                        \
-            conv(body->challenge.id1);                                         \
-            conv(body->challenge.id2);                                         \
-            conv(body->challenge.key);                                         \
-            conv(body->challenge.chid);                                        \
-            conv(body->challenge.action);                                      \
-            break;                                                             \
-        case CHALLENGE_R:                                                      \
-            conv(body->challenge_r.error);                                     \
-            conv(body->challenge_r.id1);                                       \
-            conv(body->challenge_r.id2);                                       \
-            conv(body->challenge_r.chid);                                      \
-            conv(body->challenge_r.is_id1);                                    \
-            break;                                                             \
-        case TURN:                                                             \
-            conv(body->turn.user);                                             \
-            conv(body->turn.chid);                                             \
-            conv(body->turn.key);                                              \
-            conv(body->turn.turn_no);                                          \
-            conv(body->turn.action);                                           \
-            break;                                                             \
-        case TURN_R:                                                           \
-            conv(body->turn_r.chid);                                           \
-            conv(body->turn_r.turn_no);                                        \
-            conv(body->turn_r.action1);                                        \
-            conv(body->turn_r.action2);                                        \
-            conv(body->turn_r.hp1);                                            \
-            conv(body->turn_r.hp2);                                            \
-            conv(body->turn_r.maxhp1);                                         \
-            conv(body->turn_r.maxhp2);                                         \
-            conv(body->turn_r.fin);                                            \
-            conv(body->turn_r.winner);                                         \
-            break;                                                             \
-        case SENDMSG:                                                          \
-            conv(body->sendmsg.id);                                            \
-            conv(body->sendmsg.key);                                           \
-            break;                                                             \
-        default:                                                               \
-            assert(0);                                                         \
-            break;                                                             \
+    }
+#define enc_vstr(name, len)                                                    \
+    {                                                                          \
+        size_t cnt = is_compact ? vstr_len(src->name, (len)) : (len);          \
+        memcpy(out + off, src->name, cnt);                                     \
+        off += cnt;                                                            \
+    }
+#define enc_ext(type, name)                                                    \
+    if (features) {                                                            \
+        enc_int(type, name)                                                    \
+    }
+#define enc_id(name)                                                           \
+    put_be(out + off, src->name, id_size);                                     \
+    off += id_size;
+#define enc_host(type, name)                                                   \
+    if (features & MSG_FEAT_ID32) {                                            \
+        enc_int(type, name)                                                    \
+    } else {                                                                   \
+        memcpy(out + off, &src->name, sizeof(type));                           \
+        off += sizeof(type);                                                   \
+    }
+
+/* msg_decode_<name>(dst, src, len, features): decodes len bytes at src into
+ * dst. Whatever the wire form, dst gets the full layout. */
+#define dec_int(type, name)                                                    \
+    if (len - off < sizeof(type))                                              \
+        return -1;                                                             \
+    dst->name = (type)get_be(src + off, sizeof(type));                         \
+    off += sizeof(type);
+#define dec_str(name, len_)                                                    \
+    if (len - off < (len_))                                                    \
+        return -1;                                                             \
+    memmove(dst->name, src + off, (len_));                                     \
+    off += (len_);
+#define dec_arr(elem, name, max, n)                                            \
+    {                                                                          \
+        const size_t esz = msg_wire_size_##elem(NULL, features);               \
+        if (dst->n > (max) ||                                                  \
+            (len - off != dst->n * esz && len - off != (max)*esz))             \
+            return -1;                                                         \
+        for (size_t i = 0; i < dst->n; ++i) {                                  \
+            if (msg_decode_##elem(&dst->name[i], src + off, esz, features))    \
+                return -1;                                                     \
+            off += esz;                                                        \
         }                                                                      \
-    } while (0)
-#define msg_head_conv                                                          \
-    do {                                                                       \
-        conv(head->kind);                                                      \
-        conv(head->body_len);                                                  \
-    } while (0)
+        memset(&dst->name[dst->n], 0,                                          \
+               ((max)-dst->n) * sizeof(msg_##elem##_t));                       \
+        off = len;                                                             \
+    }
+#define dec_vstr(name, len_)                                                   \
+    {                                                                          \
+        size_t cnt = len - off;                                                \
+        if (cnt == 0 || cnt > (len_))                                          \
+            return -1;                                                         \
+        memmove(dst->name, src + off, cnt);                                    \
+        /* A short text must end exactly at the end of the body */            \
+        if (cnt < (len_) && strnlen(dst->name, cnt) != cnt - 1)                \
+            return -1;                                                         \
+        memset(dst->name + cnt, 0, (len_)-cnt);                                \
+        off = len;                                                             \
+    }
+#define dec_ext(type, name)                                                    \
+    if (off == len) {                                                          \
+        dst->name = 0;                                                         \
+    } else {                                                                   \
+        dec_int(type, name)                                                    \
+    }
+#define dec_id(name)                                                           \
+    if (len - off < id_size)                                                   \
+        return -1;                                                             \
+    dst->name = get_be(src + off, id_size);                                    \
+    off += id_size;
+#define dec_host(type, name)                                                   \
+    if (features & MSG_FEAT_ID32) {                                            \
+        dec_int(type, name)                                                    \
+    } else {                                                                   \
+        if (len - off < sizeof(type))                                          \
+            return -1;                                                         \
+        memcpy(&dst->name, src + off, sizeof(type));                           \
+        off += sizeof(type);                                                   \
+    }
+
+#define define_msg_codec(name)                                                 \
+    static inline int msg_check_##name(const msg_##name##_t *src) {            \
+        msg_fields_##name(chk_int, chk_str, chk_arr, chk_str, chk_int,         \
+                          chk_id, chk_int);                                    \
+        return 0;                                                              \
+    }                                                                          \
+    static inline size_t msg_wire_size_##name(const msg_##name##_t *src,       \
+                                              uint32_t features) {             \
+        size_t sz = 0;                                                         \
+        msg_fields_##name(size_int, size_str, size_arr, size_vstr, size_ext,   \
+                          size_id, size_int);                                  \
+        return sz;                                                             \
+    }                                                                          \
+    static inline size_t msg_encode_##name(const msg_##name##_t *src,          \
+                                           char *out, uint32_t features) {     \
+        size_t off = 0;                                                        \
+        msg_fields_##name(enc_int, enc_str, enc_arr, enc_vstr, enc_ext,        \
+                          enc_id, enc_host);                                   \
+        return off;                                                            \
+    }                                                                          \
+    static inline int msg_decode_##name(msg_##name##_t *dst, const char *src,  \
+                                        size_t len, uint32_t features) {       \
+        size_t off = 0;                                                        \
+        msg_fields_##name(dec_int, dec_str, dec_arr, dec_vstr, dec_ext,        \
+                          dec_id, dec_host);                                   \
+        return off == len ? msg_check_##name(dst) : -1;                        \
+    }
+#define define_msg_body_codec(_, name) define_msg_codec(name)
+// Elements come first, as the bodies call into them
+define_msg_codec(uchange_user)
+define_msg_codec(head)
+for_each_msg_kind(define_msg_body_codec)
 
 const char *msg_strerror(msg_err_t err) {
     const static char *msg_err_desc[] = {"OK",
@@ -112,6 +216,8 @@ const char *msg_strerror(msg_err_t err) {
                                          "Invalid argument",
                                          "Challenge is rejected",
                                          "Challenge has been cancelled",
+                                         "Too many requests; slow down",
+                                         "Client is too old for this server",
                                          "Other errors"};
     static_assert(ARRAY_SIZE(msg_err_desc) == ME_OTHER - ME_OK + 1, "");
 
@@ -123,159 +229,193 @@ const char *msg_strerror(msg_err_t err) {
 
 static size_t msg_body_size(msg_kind_t kind) {
     switch (kind) {
-    case JOIN:
-        return sizeof(msg_join_t);
-        break;
-    case JOIN_R:
-        return sizeof(msg_join_r_t);
-        break;
-    case QUIT:
-        return sizeof(msg_quit_t);
-        break;
-    case UCHANGE:
-        return sizeof(msg_uchange_t);
-        break;
-    case CHALLENGE:
-        return sizeof(msg_challenge_t);
-        break;
-    case CHALLENGE_R:
-        return sizeof(msg_challenge_r_t);
-        break;
-    case TURN:
-        return sizeof(msg_turn_t);
-        break;
-    case TURN_R:
-        return sizeof(msg_turn_r_t);
-        break;
-    case SENDMSG:
-        return sizeof(msg_sendmsg_t);
-        break;
-    case MSG_MAX:
+#define case_body_size(KIND, name)                                             \
+    case KIND:                                                                 \
+        return sizeof(msg_##name##_t);
+        for_each_msg_kind(case_body_size)
+#undef case_body_size
+    default:
         return 0;
-        break;
     }
-    log_error("Please implement me (kind = %d): %s:%d", kind, __FILE__,
-              __LINE__);
-    return 0;
 }
 
-int msg_check_form(const struct message_t *buf) {
-    if (buf->head.kind <= 0 || buf->head.kind >= MSG_MAX)
+void init_msg_buf(message_t *msg, msg_kind_t kind) {
+    memset(msg, 0, sizeof(*msg));
+    msg->head.kind = kind;
+    msg->head.body_len = msg_body_size(kind);
+}
+
+/* A message on the heap, preceded by the size class it was taken from */
+typedef struct msg_buf_t {
+    uint64_t cls;
+    message_t msg;
+} msg_buf_t;
+
+// Most bytes of head and body in each class; only UCHANGE needs the last one
+static const size_t msg_class_cap[] = {64, 256, sizeof(message_t)};
+static_assert(sizeof(message_t) > 256, "");
+static pool_t msg_pools[] = {
+    POOL_INITIALIZER_SIZE("message_t/64", offsetof(msg_buf_t, msg) + 64),
+    POOL_INITIALIZER_SIZE("message_t/256", offsetof(msg_buf_t, msg) + 256),
+    POOL_INITIALIZER("message_t", msg_buf_t)};
+
+message_t *make_msg_buf(msg_kind_t kind) {
+    size_t sz = sizeof(msg_head_t) + msg_body_size(kind);
+    uint64_t cls = 0;
+    while (msg_class_cap[cls] < sz)
+        ++cls;
+    msg_buf_t *mb = pool_alloc(&msg_pools[cls]);
+    mb->cls = cls;
+    memset(&mb->msg, 0, sz);
+    mb->msg.head.kind = kind;
+    mb->msg.head.body_len = msg_body_size(kind);
+    return &mb->msg;
+}
+
+void msg_free(message_t *msg) {
+    if (msg == NULL)
+        return;
+    msg_buf_t *mb = (msg_buf_t *)((char *)msg - offsetof(msg_buf_t, msg));
+    pool_free(&msg_pools[mb->cls], mb);
+}
+
+int msg_head_decode(msg_head_t *head) {
+    if (msg_decode_head(head, (const char *)head, sizeof(*head), 0) != 0)
+        return -1;
+    msg_kind_t kind = head->kind & ~MSG_KIND_ID32;
+    if (kind <= MSG_MIN || kind >= MSG_MAX) {
         return -1;
-    if (buf->head.body_len != msg_body_size(buf->head.kind))
+    }
+    if (head->body_len > msg_body_size(kind)) {
         return -1;
+    }
+    return 0;
+}
+
+/* Decodes the body_len bytes at src, which must not overlap buf, into buf,
+ * whose head has been decoded */
+static int msg_body_decode_from(struct message_t *buf, const char *src) {
+    size_t len = buf->head.body_len;
+    uint32_t features = buf->head.kind & MSG_KIND_ID32 ? MSG_FEAT_ID32 : 0;
+    int res = -1;
+    buf->head.kind &= ~MSG_KIND_ID32;
     switch ((msg_kind_t)buf->head.kind) {
-    case JOIN:
-        check_nt(buf, join, nickname);
-        break;
-    case JOIN_R:
-        check_nt(buf, join_r, nickname);
-        break;
-    case UCHANGE:
-        if (buf->body.uchange.count > UCHANGE_MAX_UCNT) {
-            return -1;
-        }
-        for (size_t i = 0; i < buf->body.uchange.count; ++i) {
-            check_nt(buf, uchange.users[i], nickname);
-        }
-        break;
-    case SENDMSG:
-        check_nt(buf, sendmsg, text);
+#define case_decode(KIND, name)                                                \
+    case KIND:                                                                 \
+        res = msg_decode_##name(&buf->body.name, src, len, features);          \
         break;
-    case QUIT:
-    case CHALLENGE:
-    case CHALLENGE_R:
-    case TURN:
-    case TURN_R:
-        break;
-    case MSG_MAX:
+        for_each_msg_kind(case_decode)
+#undef case_decode
     default:
-        return -1;
         break;
     }
-    return 0;
+    buf->head.body_len = msg_body_size(buf->head.kind);
+    return res;
 }
 
-void init_msg_buf(message_t *msg, msg_kind_t kind) {
-    memset(msg, 0, sizeof(*msg));
-    msg->head.kind = kind;
-    msg->head.body_len = msg_body_size(kind);
-}
+void frame_reader_init(frame_reader_t *fr) { fr->start = fr->len = 0; }
 
-message_t *make_msg_buf(msg_kind_t kind) {
-    message_t *msg = xmalloc(sizeof(*msg));
-    init_msg_buf(msg, kind);
-    return msg;
+void *frame_reader_space(frame_reader_t *fr, size_t *room) {
+    if (fr->start > 0) {
+        memmove(fr->data, fr->data + fr->start, fr->len - fr->start);
+        fr->len -= fr->start;
+        fr->start = 0;
+    }
+    // A frame is never longer than sizeof(message_t), so a partial one
+    // leaves room
+    assert(fr->len < sizeof(fr->data));
+    *room = sizeof(fr->data) - fr->len;
+    return fr->data + fr->len;
 }
 
-static void msg_head_n2l(msg_head_t *head) {
-    const bool l2n = false;
-    msg_head_conv;
+void frame_reader_filled(frame_reader_t *fr, size_t cnt) {
+    fr->len += cnt;
+    assert(fr->len <= sizeof(fr->data));
 }
 
-static void msg_head_l2n(msg_head_t *head) {
-    const bool l2n = true;
-    msg_head_conv;
+int frame_reader_next(frame_reader_t *fr, struct message_t *buf) {
+    size_t avail = fr->len - fr->start;
+    const char *p = fr->data + fr->start;
+    if (avail < sizeof(buf->head))
+        return 0;
+    memcpy(&buf->head, p, sizeof(buf->head));
+    if (msg_head_decode(&buf->head) != 0)
+        return -1;
+    size_t sz = sizeof(buf->head) + buf->head.body_len;
+    if (avail < sz)
+        return 0;
+    fr->start += sz;
+    return msg_body_decode_from(buf, p + sizeof(buf->head)) == 0 ? 1 : -1;
 }
 
-static void msg_body_n2l(msg_kind_t kind, msg_body_t *body) {
-    const bool l2n = false;
-    msg_body_conv;
+ssize_t frame_reader_recv(frame_reader_t *fr, int fd, int flags) {
+    size_t room;
+    void *p = frame_reader_space(fr, &room);
+    ssize_t cnt = recv(fd, p, room, flags);
+    if (cnt > 0)
+        frame_reader_filled(fr, cnt);
+    return cnt;
 }
 
-static void msg_body_l2n(msg_kind_t kind, msg_body_t *body) {
-    const bool l2n = true;
-    msg_body_conv;
+size_t msg_wire_size(const struct message_t *buf, uint32_t features) {
+    switch ((msg_kind_t)buf->head.kind) {
+#define case_wire_size(KIND, name)                                             \
+    case KIND:                                                                 \
+        return sizeof(buf->head) +                                             \
+               msg_wire_size_##name(&buf->body.name, features);
+        for_each_msg_kind(case_wire_size)
+#undef case_wire_size
+    default:
+        return 0;
+    }
 }
 
-int msg_recv(int fd, struct message_t *buf, bool block_at_head) {
-    if (recv_count(fd, buf, sizeof(buf->head), block_at_head) != 0) {
-        return -1;
-    }
-    msg_head_n2l(&buf->head);
-    if (buf->head.kind <= 0 || buf->head.kind >= MSG_MAX) {
-        return -1;
-    }
-    size_t body_len = buf->head.body_len;
-    if (body_len != msg_body_size(buf->head.kind)) {
-        return -1;
-    }
-    if (recv_count(fd, &buf->body, body_len, true) != 0) {
-        return -1;
+size_t msg_encode(const struct message_t *buf, void *out, uint32_t features) {
+    msg_head_t head = {.kind = buf->head.kind};
+    char *p = (char *)out + sizeof(head);
+    switch ((msg_kind_t)buf->head.kind) {
+#define case_encode(KIND, name)                                                \
+    case KIND:                                                                 \
+        head.body_len = msg_encode_##name(&buf->body.name, p, features);       \
+        break;
+        for_each_msg_kind(case_encode)
+#undef case_encode
+    default:
+        return 0;
     }
-    msg_body_n2l(buf->head.kind, &buf->body);
-    return msg_check_form(buf);
+    if (features & MSG_FEAT_ID32)
+        head.kind |= MSG_KIND_ID32;
+    msg_encode_head(&head, out, features);
+    return sizeof(head) + head.body_len;
 }
 
-int msg_send(int fd, const struct message_t *orig) {
+int msg_send(int fd, const struct message_t *orig, uint32_t features) {
     message_t buf;
-    static_assert(sizeof(buf) == sizeof(*orig), "");
-    size_t body_len = orig->head.body_len;
-    if (orig->head.kind <= 0 || orig->head.kind >= MSG_MAX) {
+    size_t sz = msg_encode(orig, &buf, features);
+    if (sz == 0) {
         return -1;
     }
-    size_t sz = sizeof(orig->head) + body_len;
-    memcpy(&buf, orig, sz);
-    msg_body_l2n(buf.head.kind, &buf.body);
-    msg_head_l2n(&buf.head);
-    return send(fd, &buf, sz, 0) == sz ? 0 : -1;
+    return send_count(fd, &buf, sz);
 }
 
 message_t *msg_dup(const message_t *orig) {
     assert(orig);
     message_t *msg = make_msg_buf(orig->head.kind);
+    // Only as much as the size class of the kind holds
     memcpy(msg, orig,
-           min_(sizeof(orig->head) + orig->head.body_len, sizeof(*orig)));
+           sizeof(orig->head) +
+               min_(orig->head.body_len, msg_body_size(orig->head.kind)));
     return msg;
 }
 
 message_t *make_join(const char *nickname) {
     message_t *msg = make_msg_buf(JOIN);
     snprintf(msg->body.join.nickname, NICKNAME_LEN, "%s", nickname);
+    msg->body.join.features = MSG_FEATURES;
     return msg;
 }
 
-message_t *make_join_r(const char *nickname, uint16_t error, uint16_t id,
+message_t *make_join_r(const char *nickname, uint16_t error, uint32_t id,
                        uint32_t key) {
     message_t *msg = make_msg_buf(JOIN_R);
     snprintf(msg->body.join_r.nickname, NICKNAME_LEN, "%s", nickname);
@@ -299,7 +439,7 @@ message_t *make_challenge() {
 void init_challenge_r(message_t *msg) { init_msg_buf(msg, CHALLENGE_R); }
 
 bool uchange_add_or_create(message_t *msg, message_t **newmsg,
-                           const char *nickname, uint16_t id,
+                           const char *nickname, uint32_t id,
                            user_state_t state, int32_t score) {
     uint32_t cnt = msg->body.uchange.count;
     if (cnt >= UCHANGE_MAX_UCNT) {
@@ -0,0 +1,151 @@
+#include "common.h"
+#include <limits.h>
+
+/* A bounded ring after Dmitry Vyukov's: slot i is free for the producer that
+ * claims position pos when seq == pos and holds an entry for the consumer
+ * when seq == pos + 1. Producers claim positions with a CAS on tail; the
+ * consumer owns head. */
+typedef struct mpsc_slot_t {
+    atomic_size_t seq;
+    void *data;
+} mpsc_slot_t;
+
+struct mpsc_queue_t {
+    mpsc_slot_t *slots;
+    size_t mask;
+    // Producers and the consumer write these; keep them on separate lines
+    _Alignas(64) atomic_size_t tail;
+    _Alignas(64) size_t head;
+    // Set while the consumer sleeps (or is about to) on an empty queue
+    atomic_uint consumer_parked;
+    // Bumped by the consumer when it frees slots and producers wait
+    _Alignas(64) atomic_uint space_seq;
+    atomic_uint full_waiters;
+};
+
+mpsc_queue_t *mpsc_create(size_t cap) {
+    size_t n = 2;
+    while (n < cap)
+        n *= 2;
+    mpsc_queue_t *q = xcalloc_aligned(_Alignof(mpsc_queue_t), sizeof(*q));
+    q->slots = xmalloc(n * sizeof(*q->slots));
+    for (size_t i = 0; i < n; ++i)
+        atomic_init(&q->slots[i].seq, i);
+    q->mask = n - 1;
+    return q;
+}
+
+void mpsc_destroy(mpsc_queue_t *q) {
+    free(q->slots);
+    free(q);
+}
+
+/* Claims a position; returns false if the ring is full. */
+static bool mpsc_claim(mpsc_queue_t *q, size_t *ppos) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1) {
+        mpsc_slot_t *s = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *ppos = pos;
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+queue_err_t mpsc_add(mpsc_queue_t *q, void *e, bool block) {
+    size_t pos;
+    while (!mpsc_claim(q, &pos)) {
+        if (!block)
+            return QFULL;
+        unsigned seq = atomic_load(&q->space_seq);
+        atomic_fetch_add(&q->full_waiters, 1);
+        // Pairs with the fence in mpsc_take_batch(): either the consumer
+        // sees the waiter, or the claim below sees the freed slot
+        atomic_thread_fence(memory_order_seq_cst);
+        bool claimed = mpsc_claim(q, &pos);
+        if (!claimed)
+            futex_wait(&q->space_seq, seq);
+        atomic_fetch_sub(&q->full_waiters, 1);
+        if (claimed)
+            break;
+    }
+    mpsc_slot_t *s = &q->slots[pos & q->mask];
+    s->data = e;
+    atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+
+    // Pairs with the fence in mpsc_park()
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->consumer_parked, memory_order_relaxed) &&
+        atomic_exchange(&q->consumer_parked, 0)) {
+        futex_wake(&q->consumer_parked, 1);
+    }
+    return QOK;
+}
+
+static bool mpsc_ready(const mpsc_queue_t *q) {
+    const mpsc_slot_t *s = &q->slots[q->head & q->mask];
+    return atomic_load_explicit(&s->seq, memory_order_acquire) == q->head + 1;
+}
+
+/* Sleeps until a producer publishes an entry, or for timeout_ns nanoseconds
+ * at most unless it is 0. */
+static void mpsc_park(mpsc_queue_t *q, long timeout_ns) {
+    atomic_store_explicit(&q->consumer_parked, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    // A slot may be claimed but not published yet; its producer wakes us
+    if (!mpsc_ready(q)) {
+        if (timeout_ns)
+            futex_wait_for(&q->consumer_parked, 1, timeout_ns);
+        else
+            futex_wait(&q->consumer_parked, 1);
+    }
+    atomic_store_explicit(&q->consumer_parked, 0, memory_order_relaxed);
+}
+
+static size_t mpsc_take(mpsc_queue_t *q, void **out, size_t max, bool block,
+                        long timeout_ns) {
+    size_t n = 0;
+    while (n < max) {
+        if (!mpsc_ready(q)) {
+            if (n || !block)
+                break;
+            mpsc_park(q, timeout_ns);
+            // A timed wait is only tried once
+            block = timeout_ns == 0;
+            continue;
+        }
+        mpsc_slot_t *s = &q->slots[q->head & q->mask];
+        out[n++] = s->data;
+        atomic_store_explicit(&s->seq, q->head + q->mask + 1,
+                              memory_order_release);
+        ++q->head;
+    }
+    if (n) {
+        // Pairs with the fence in mpsc_add()
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&q->full_waiters, memory_order_relaxed)) {
+            atomic_fetch_add(&q->space_seq, 1);
+            futex_wake(&q->space_seq, INT_MAX);
+        }
+    }
+    return n;
+}
+
+size_t mpsc_take_batch(mpsc_queue_t *q, void **out, size_t max, bool block) {
+    return mpsc_take(q, out, max, block, 0);
+}
+
+size_t mpsc_take_batch_for(mpsc_queue_t *q, void **out, size_t max,
+                           long timeout_ns) {
+    return mpsc_take(q, out, max, true, max_(timeout_ns, 1));
+}
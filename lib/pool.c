@@ -0,0 +1,162 @@
+#include "common.h"
+
+// Free objects a thread may keep for one pool; half of them are given back
+// to the pool when there are more
+#define POOL_CACHE 64
+// Objects taken from the heap at once
+#define POOL_CHUNK 64
+// Most pools in a process
+#define POOL_MAX 16
+
+/* A free object; free lists are threaded through the objects themselves */
+typedef struct pool_node_t {
+    struct pool_node_t *next;
+} pool_node_t;
+
+typedef struct pool_cache_t {
+    pool_node_t *head;
+    size_t cnt;
+} pool_cache_t;
+
+static pool_t *pools[POOL_MAX];
+static unsigned pool_cnt = 0;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+// Indexed by the pool's idx - 1
+static _Thread_local pool_cache_t caches[POOL_MAX];
+static _Thread_local bool caches_used = false;
+// Gives the caches back when a thread exits
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/* Moves the first cnt objects of c to the pool's free list. */
+static void pool_give_back(pool_t *pool, pool_cache_t *c, size_t cnt) {
+    if (cnt == 0)
+        return;
+    pool_node_t *head = c->head, *tail = head;
+    for (size_t i = 1; i < cnt; ++i)
+        tail = tail->next;
+    c->head = tail->next;
+    c->cnt -= cnt;
+    pthread_mutex_lock(&pool->lock);
+    tail->next = pool->free;
+    pool->free = head;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void caches_release(void *pcaches) {
+    pool_cache_t *cs = pcaches;
+    pthread_mutex_lock(&pools_lock);
+    unsigned cnt = pool_cnt;
+    pthread_mutex_unlock(&pools_lock);
+    for (unsigned i = 0; i < cnt; ++i)
+        pool_give_back(pools[i], &cs[i], cs[i].cnt);
+}
+
+static void cache_key_init() {
+    if (pthread_key_create(&cache_key, caches_release) != 0)
+        panic("pthread_key_create()");
+}
+
+static void pool_register(pool_t *pool) {
+    pthread_mutex_lock(&pools_lock);
+    if (atomic_load_explicit(&pool->idx, memory_order_relaxed) == 0) {
+        if (pool_cnt == POOL_MAX)
+            panic("Too many pools");
+        // Free objects must hold a pool_node_t and stay aligned
+        size_t align = _Alignof(max_align_t);
+        pool->size = (max_(pool->size, sizeof(pool_node_t)) + align - 1) /
+                     align * align;
+        pools[pool_cnt++] = pool;
+        atomic_store_explicit(&pool->idx, pool_cnt, memory_order_release);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
+
+static pool_cache_t *pool_cache(pool_t *pool) {
+    unsigned idx = atomic_load_explicit(&pool->idx, memory_order_acquire);
+    if (idx == 0) {
+        pool_register(pool);
+        idx = atomic_load_explicit(&pool->idx, memory_order_acquire);
+    }
+    if (!caches_used) {
+        pthread_once(&cache_key_once, cache_key_init);
+        pthread_setspecific(cache_key, caches);
+        caches_used = true;
+    }
+    return &caches[idx - 1];
+}
+
+/* Takes up to half a cache from the pool's free list, or a new chunk from the
+ * heap if it is empty. */
+static void pool_refill(pool_t *pool, pool_cache_t *c) {
+    pthread_mutex_lock(&pool->lock);
+    while (c->cnt < POOL_CACHE / 2 && pool->free) {
+        pool_node_t *n = pool->free;
+        pool->free = n->next;
+        n->next = c->head;
+        c->head = n;
+        ++c->cnt;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (c->cnt)
+        return;
+
+    char *chunk = xmalloc(POOL_CHUNK * pool->size);
+    for (size_t i = POOL_CHUNK; i-- > 0;) {
+        pool_node_t *n = (pool_node_t *)(chunk + i * pool->size);
+        n->next = c->head;
+        c->head = n;
+    }
+    c->cnt = POOL_CHUNK;
+    atomic_fetch_add_explicit(&pool->reserved, POOL_CHUNK,
+                              memory_order_relaxed);
+}
+
+void *pool_alloc(pool_t *pool) {
+    pool_cache_t *c = pool_cache(pool);
+    if (c->head == NULL)
+        pool_refill(pool, c);
+    pool_node_t *n = c->head;
+    c->head = n->next;
+    --c->cnt;
+
+    size_t live =
+        atomic_fetch_add_explicit(&pool->live, 1, memory_order_relaxed) + 1;
+    size_t peak = atomic_load_explicit(&pool->peak, memory_order_relaxed);
+    while (live > peak &&
+           !atomic_compare_exchange_weak_explicit(&pool->peak, &peak, live,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+    return n;
+}
+
+void *pool_calloc(pool_t *pool) {
+    void *p = pool_alloc(pool);
+    memset(p, 0, pool->size);
+    return p;
+}
+
+void pool_free(pool_t *pool, void *p) {
+    if (p == NULL)
+        return;
+    pool_cache_t *c = pool_cache(pool);
+    pool_node_t *n = p;
+    n->next = c->head;
+    c->head = n;
+    if (++c->cnt > POOL_CACHE)
+        pool_give_back(pool, c, POOL_CACHE / 2);
+    atomic_fetch_sub_explicit(&pool->live, 1, memory_order_relaxed);
+}
+
+void pool_log_stats(void) {
+    pthread_mutex_lock(&pools_lock);
+    for (unsigned i = 0; i < pool_cnt; ++i) {
+        const pool_t *pool = pools[i];
+        log_info("Pool %s: %zu live, %zu peak, %zu allocated (%zu bytes each)",
+                 pool->name, atomic_load(&pool->live),
+                 atomic_load(&pool->peak), atomic_load(&pool->reserved),
+                 pool->size);
+    }
+    pthread_mutex_unlock(&pools_lock);
+}
@@ -0,0 +1,138 @@
+#include "common.h"
+
+/* A treap: nodes are in order by cmp and form a heap by prio, which keeps the
+ * expected depth logarithmic. Each node counts the nodes under it, so ranks
+ * are found on the way between a node and the root. */
+
+static size_t node_size(const ranklist_node_t *n) { return n ? n->size : 0; }
+
+static void node_resize(ranklist_node_t *n) {
+    n->size = node_size(n->left) + node_size(n->right) + 1;
+}
+
+/* Where the link to n is: the root or a child pointer of its parent */
+static ranklist_node_t **node_link(ranklist_t *list, ranklist_node_t *n) {
+    if (n->parent == NULL)
+        return &list->root;
+    return n->parent->left == n ? &n->parent->left : &n->parent->right;
+}
+
+/* Moves child c of n above n, keeping the order. */
+static void node_rotate_up(ranklist_t *list, ranklist_node_t *c) {
+    ranklist_node_t *n = c->parent, **link = node_link(list, n);
+    if (n->left == c) {
+        n->left = c->right;
+        if (n->left)
+            n->left->parent = n;
+        c->right = n;
+    } else {
+        n->right = c->left;
+        if (n->right)
+            n->right->parent = n;
+        c->left = n;
+    }
+    c->parent = n->parent;
+    n->parent = c;
+    *link = c;
+    node_resize(n);
+    node_resize(c);
+}
+
+void ranklist_init(ranklist_t *list,
+                   int (*cmp)(const ranklist_node_t *, const ranklist_node_t *,
+                              void *),
+                   void *arg) {
+    list->root = NULL;
+    list->cmp = cmp;
+    list->arg = arg;
+    list->seed = 0x9e3779b9u;
+}
+
+void ranklist_insert(ranklist_t *list, ranklist_node_t *node) {
+    // xorshift32
+    uint32_t x = list->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    list->seed = x;
+
+    node->left = node->right = NULL;
+    node->size = 1;
+    node->prio = x;
+    ranklist_node_t *parent = NULL, **link = &list->root;
+    while (*link) {
+        parent = *link;
+        ++parent->size;
+        link = list->cmp(node, parent, list->arg) < 0 ? &parent->left
+                                                       : &parent->right;
+    }
+    node->parent = parent;
+    *link = node;
+    while (node->parent && node->parent->prio < node->prio)
+        node_rotate_up(list, node);
+}
+
+void ranklist_remove(ranklist_t *list, ranklist_node_t *node) {
+    // Sinks to a leaf below the child that has to come up
+    while (node->left || node->right) {
+        ranklist_node_t *c = node->left;
+        if (c == NULL || (node->right && node->right->prio > c->prio))
+            c = node->right;
+        node_rotate_up(list, c);
+    }
+    *node_link(list, node) = NULL;
+    for (ranklist_node_t *p = node->parent; p; p = p->parent)
+        --p->size;
+    node->parent = NULL;
+}
+
+size_t ranklist_size(const ranklist_t *list) { return node_size(list->root); }
+
+size_t ranklist_rank(const ranklist_node_t *node) {
+    size_t rank = node_size(node->left);
+    for (; node->parent; node = node->parent) {
+        if (node->parent->right == node)
+            rank += node_size(node->parent->left) + 1;
+    }
+    return rank;
+}
+
+ranklist_node_t *ranklist_at(const ranklist_t *list, size_t rank) {
+    ranklist_node_t *n = list->root;
+    while (n) {
+        size_t left = node_size(n->left);
+        if (rank == left)
+            return n;
+        if (rank < left) {
+            n = n->left;
+        } else {
+            rank -= left + 1;
+            n = n->right;
+        }
+    }
+    return NULL;
+}
+
+ranklist_node_t *ranklist_next(const ranklist_node_t *node) {
+    if (node->right) {
+        const ranklist_node_t *n = node->right;
+        while (n->left)
+            n = n->left;
+        return (ranklist_node_t *)n;
+    }
+    while (node->parent && node->parent->right == node)
+        node = node->parent;
+    return node->parent;
+}
+
+ranklist_node_t *ranklist_prev(const ranklist_node_t *node) {
+    if (node->left) {
+        const ranklist_node_t *n = node->left;
+        while (n->right)
+            n = n->right;
+        return (ranklist_node_t *)n;
+    }
+    while (node->parent && node->parent->left == node)
+        node = node->parent;
+    return node->parent;
+}
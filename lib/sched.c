@@ -0,0 +1,274 @@
+#include "common.h"
+#include <sched.h>
+
+// Tasks a worker's deque holds; spawns beyond that go to the shared queue
+#define DEQUE_CAP 4096
+// Tasks a strand runs before it lets others on its worker have a turn
+#define STRAND_BATCH 64
+// Tasks a worker runs between two calls to idle()
+#define IDLE_EVERY 64
+
+/* The deque of Chase and Lev: the owner pushes and pops at bottom, thieves
+ * take from top. */
+typedef struct sched_deque_t {
+    _Alignas(64) atomic_llong top;
+    _Alignas(64) atomic_llong bottom;
+    _Atomic(sched_task_t *) *buf;
+} sched_deque_t;
+
+typedef struct sched_worker_t {
+    sched_deque_t deque;
+    struct sched_t *sched;
+    unsigned idx, seed;
+} sched_worker_t;
+
+struct sched_t {
+    sched_worker_t *workers;
+    unsigned cnt;
+    void (*idle)(void);
+    // Tasks spawned from outside the pool or beyond DEQUE_CAP
+    pthread_mutex_t shared_lock;
+    sched_task_t *shared_head, *shared_tail;
+    atomic_size_t shared_cnt;
+    // Bumped to wake workers sleeping for lack of tasks
+    _Alignas(64) atomic_uint work_seq;
+    atomic_uint sleepers;
+};
+
+static pool_t task_pool = POOL_INITIALIZER("sched_task_t", sched_task_t);
+static _Thread_local sched_worker_t *self = NULL;
+
+static bool deque_push(sched_deque_t *d, sched_task_t *t) {
+    long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - top >= DEQUE_CAP)
+        return false;
+    atomic_store_explicit(&d->buf[b % DEQUE_CAP], t, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+static sched_task_t *deque_pop(sched_deque_t *d) {
+    // Thieves load top, then bottom; seq_cst keeps the store to bottom
+    // ahead of the load of top here
+    long long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store(&d->bottom, b);
+    long long top = atomic_load(&d->top);
+    if (top > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+        return NULL;
+    }
+    sched_task_t *t =
+        atomic_load_explicit(&d->buf[b % DEQUE_CAP], memory_order_relaxed);
+    if (top == b) {
+        // The last task; a thief may be taking it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            t = NULL;
+        }
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    }
+    return t;
+}
+
+static sched_task_t *deque_steal(sched_deque_t *d) {
+    long long top = atomic_load(&d->top);
+    long long b = atomic_load(&d->bottom);
+    if (top >= b)
+        return NULL;
+    sched_task_t *t =
+        atomic_load_explicit(&d->buf[top % DEQUE_CAP], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return NULL;
+    }
+    return t;
+}
+
+static void shared_push(sched_t *s, sched_task_t *t) {
+    atomic_store_explicit(&t->next, NULL, memory_order_relaxed);
+    pthread_mutex_lock(&s->shared_lock);
+    if (s->shared_tail)
+        atomic_store_explicit(&s->shared_tail->next, t, memory_order_relaxed);
+    else
+        s->shared_head = t;
+    s->shared_tail = t;
+    atomic_fetch_add_explicit(&s->shared_cnt, 1, memory_order_relaxed);
+    pthread_mutex_unlock(&s->shared_lock);
+}
+
+static sched_task_t *shared_pop(sched_t *s) {
+    if (atomic_load_explicit(&s->shared_cnt, memory_order_relaxed) == 0)
+        return NULL;
+    pthread_mutex_lock(&s->shared_lock);
+    sched_task_t *t = s->shared_head;
+    if (t) {
+        s->shared_head = atomic_load_explicit(&t->next, memory_order_relaxed);
+        if (s->shared_head == NULL)
+            s->shared_tail = NULL;
+        atomic_fetch_sub_explicit(&s->shared_cnt, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&s->shared_lock);
+    return t;
+}
+
+/* Own deque first, then the shared queue, then the others from a random
+ * one on. */
+static sched_task_t *sched_find(sched_worker_t *w) {
+    sched_t *s = w->sched;
+    sched_task_t *t = deque_pop(&w->deque);
+    if (t == NULL)
+        t = shared_pop(s);
+    if (t == NULL && s->cnt > 1) {
+        unsigned start = rand_r(&w->seed) % s->cnt;
+        for (unsigned i = 0; i < s->cnt && t == NULL; ++i) {
+            sched_worker_t *victim = &s->workers[(start + i) % s->cnt];
+            if (victim != w)
+                t = deque_steal(&victim->deque);
+        }
+    }
+    return t;
+}
+
+/* Sleeps until a task may have been spawned; returns one if found first. */
+static sched_task_t *sched_park(sched_worker_t *w) {
+    sched_t *s = w->sched;
+    // Pairs with the fence in sched_spawn(): either the spawner sees a
+    // sleeper, or the search below sees the task
+    atomic_fetch_add(&s->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned seq = atomic_load(&s->work_seq);
+    sched_task_t *t = sched_find(w);
+    if (t == NULL)
+        futex_wait(&s->work_seq, seq);
+    atomic_fetch_sub(&s->sleepers, 1);
+    return t;
+}
+
+static void *sched_worker_main(void *pw) {
+    sched_worker_t *w = pw;
+    self = w;
+    for (unsigned ran = 0;;) {
+        sched_task_t *t = sched_find(w);
+        if (t == NULL) {
+            if (w->sched->idle)
+                w->sched->idle();
+            ran = 0;
+            if ((t = sched_park(w)) == NULL)
+                continue;
+        }
+        t->fn(t->arg);
+        pool_free(&task_pool, t);
+        if (++ran == IDLE_EVERY && w->sched->idle) {
+            w->sched->idle();
+            ran = 0;
+        }
+    }
+    return 0;
+}
+
+sched_t *sched_create(unsigned workers, void (*idle)(void)) {
+    assert(workers > 0);
+    sched_t *s = xcalloc_aligned(_Alignof(sched_t), sizeof(*s));
+    s->cnt = workers;
+    s->idle = idle;
+    pthread_mutex_init(&s->shared_lock, NULL);
+    s->workers = xcalloc_aligned(_Alignof(sched_worker_t),
+                                 workers * sizeof(*s->workers));
+    for (unsigned i = 0; i < workers; ++i) {
+        sched_worker_t *w = &s->workers[i];
+        w->deque.buf = xcalloc(DEQUE_CAP, sizeof(*w->deque.buf));
+        w->sched = s;
+        w->idx = i;
+        w->seed = i * 0x9e3779b9u + 1;
+    }
+    for (unsigned i = 0; i < workers; ++i)
+        xthread_create(sched_worker_main, &s->workers[i]);
+    return s;
+}
+
+void sched_spawn(sched_t *s, void (*fn)(void *), void *arg) {
+    sched_task_t *t = pool_alloc(&task_pool);
+    t->fn = fn;
+    t->arg = arg;
+    if (self == NULL || self->sched != s || !deque_push(&self->deque, t))
+        shared_push(s, t);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&s->sleepers, memory_order_relaxed)) {
+        atomic_fetch_add(&s->work_seq, 1);
+        futex_wake(&s->work_seq, 1);
+    }
+}
+
+/* Strands queue their tasks on an intrusive list after Dmitry Vyukov's: any
+ * thread pushes with one exchange, and the one task running the strand pops.
+ * pending counts the tasks pushed and not yet run; the thread that makes it
+ * non-zero spawns the task that runs the strand. */
+
+static void strand_push(strand_t *st, sched_task_t *t) {
+    atomic_store_explicit(&t->next, NULL, memory_order_relaxed);
+    sched_task_t *prev = atomic_exchange(&st->tail, t);
+    atomic_store_explicit(&prev->next, t, memory_order_release);
+}
+
+/* Returns NULL if the list is empty or a push is half done. */
+static sched_task_t *strand_pop(strand_t *st) {
+    sched_task_t *head = st->head,
+                 *next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (head == &st->stub) {
+        if (next == NULL)
+            return NULL;
+        st->head = head = next;
+        next = atomic_load_explicit(&head->next, memory_order_acquire);
+    }
+    if (next) {
+        st->head = next;
+        return head;
+    }
+    if (head != atomic_load(&st->tail))
+        return NULL;
+    // head is the last task; the stub goes behind it so that it can leave
+    strand_push(st, &st->stub);
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+    if (next == NULL)
+        return NULL;
+    st->head = next;
+    return head;
+}
+
+static void strand_run(void *pst) {
+    strand_t *st = pst;
+    for (unsigned n = 0;; ++n) {
+        if (n == STRAND_BATCH) {
+            sched_spawn(st->sched, strand_run, st);
+            return;
+        }
+        sched_task_t *t;
+        // pending says there is one; its push may not be linked yet
+        while ((t = strand_pop(st)) == NULL)
+            sched_yield();
+        t->fn(t->arg);
+        pool_free(&task_pool, t);
+        if (atomic_fetch_sub(&st->pending, 1) == 1)
+            return;
+    }
+}
+
+void strand_init(strand_t *st, sched_t *s) {
+    st->sched = s;
+    atomic_init(&st->stub.next, NULL);
+    atomic_init(&st->tail, &st->stub);
+    st->head = &st->stub;
+    atomic_init(&st->pending, 0);
+}
+
+void strand_post(strand_t *st, void (*fn)(void *), void *arg) {
+    sched_task_t *t = pool_alloc(&task_pool);
+    t->fn = fn;
+    t->arg = arg;
+    strand_push(st, t);
+    if (atomic_fetch_add(&st->pending, 1) == 0)
+        sched_spawn(st->sched, strand_run, st);
+}
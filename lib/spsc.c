@@ -0,0 +1,124 @@
+#include "common.h"
+
+/* Entries [head, tail) are queued, and [tail, staged) written but not yet
+ * published. Each side keeps a copy of the other's index and only reloads it
+ * when the copy says full or empty, so the shared lines move between cores
+ * once per batch rather than per entry. Waking the other side costs a full
+ * fence, which is likewise paid once per published or taken batch. */
+struct spsc_ring_t {
+    void **slots;
+    size_t mask;
+    // Producer side
+    _Alignas(64) atomic_size_t tail;
+    size_t staged, head_cache;
+    // Consumer side
+    _Alignas(64) atomic_size_t head;
+    size_t tail_cache;
+    // Each only written when its side sleeps, and when it is woken
+    _Alignas(64) atomic_uint producer_parked;
+    _Alignas(64) atomic_uint consumer_parked;
+};
+
+spsc_ring_t *spsc_create(size_t cap) {
+    size_t n = 2;
+    while (n < cap)
+        n *= 2;
+    spsc_ring_t *r = xcalloc_aligned(_Alignof(spsc_ring_t), sizeof(*r));
+    r->slots = xmalloc(n * sizeof(*r->slots));
+    r->mask = n - 1;
+    return r;
+}
+
+void spsc_destroy(spsc_ring_t *r) {
+    free(r->slots);
+    free(r);
+}
+
+/* Wakes the other side if it sleeps on *parked. */
+static void spsc_wake(atomic_uint *parked) {
+    // Pairs with the fence in spsc_park(): either the sleeper sees the
+    // index just published, or we see it parked
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(parked, memory_order_relaxed) &&
+        atomic_exchange(parked, 0)) {
+        futex_wake(parked, 1);
+    }
+}
+
+/* Sleeps on *parked unless ready() turns true. */
+static void spsc_park(spsc_ring_t *r, atomic_uint *parked,
+                      bool (*ready)(spsc_ring_t *)) {
+    atomic_store_explicit(parked, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready(r))
+        futex_wait(parked, 1);
+    atomic_store_explicit(parked, 0, memory_order_relaxed);
+}
+
+static bool spsc_has_room(spsc_ring_t *r) {
+    if (r->staged - r->head_cache <= r->mask)
+        return true;
+    r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+    return r->staged - r->head_cache <= r->mask;
+}
+
+static bool spsc_has_entries(spsc_ring_t *r) {
+    size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (r->tail_cache != h)
+        return true;
+    r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+    return r->tail_cache != h;
+}
+
+static bool spsc_try_stage(spsc_ring_t *r, void *e) {
+    if (!spsc_has_room(r))
+        return false;
+    r->slots[r->staged++ & r->mask] = e;
+    return true;
+}
+
+void spsc_publish(spsc_ring_t *r) {
+    if (atomic_load_explicit(&r->tail, memory_order_relaxed) == r->staged)
+        return;
+    atomic_store_explicit(&r->tail, r->staged, memory_order_release);
+    spsc_wake(&r->consumer_parked);
+}
+
+void spsc_stage(spsc_ring_t *r, void *e) {
+    while (!spsc_try_stage(r, e)) {
+        // The consumer cannot make room for what it does not see
+        spsc_publish(r);
+        spsc_park(r, &r->producer_parked, spsc_has_room);
+    }
+}
+
+bool spsc_try_add(spsc_ring_t *r, void *e) {
+    if (!spsc_try_stage(r, e))
+        return false;
+    spsc_publish(r);
+    return true;
+}
+
+void spsc_add(spsc_ring_t *r, void *e) {
+    spsc_stage(r, e);
+    spsc_publish(r);
+}
+
+size_t spsc_try_take_batch(spsc_ring_t *r, void **out, size_t max) {
+    if (max == 0 || !spsc_has_entries(r))
+        return 0;
+    size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t n = min_(r->tail_cache - h, max);
+    for (size_t i = 0; i < n; ++i)
+        out[i] = r->slots[(h + i) & r->mask];
+    atomic_store_explicit(&r->head, h + n, memory_order_release);
+    spsc_wake(&r->producer_parked);
+    return n;
+}
+
+size_t spsc_take_batch(spsc_ring_t *r, void **out, size_t max) {
+    size_t n;
+    while ((n = spsc_try_take_batch(r, out, max)) == 0 && max)
+        spsc_park(r, &r->consumer_parked, spsc_has_entries);
+    return n;
+}
@@ -0,0 +1,626 @@
+#include "net.h"
+#include <limits.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+static mpsc_queue_t *incoming_queue = NULL;
+static const net_backend_ops_t *backend = NULL;
+static bool pin_reactors = false;
+static size_t outbuf_limit;
+static slow_policy_t slow_policy;
+static bool (*dispatch)(queue_entry_t *entry) = NULL;
+static rate_limit_t conn_rate, kind_rate[MSG_MAX];
+static bool (*rate_exempt)(const message_t *msg) = NULL;
+static bool (*throttle_reply)(const message_t *msg, message_t *reply) = NULL;
+// Set if any of the rate limits is
+static bool rate_limited = false;
+// Messages dropped by the rate limits, by kind
+static atomic_ulong throttled[MSG_MAX];
+// Connections this thread queued messages on since its last net_flush()
+static _Thread_local conn_list_t dirty_conns;
+// This thread's bit in conn_t.dirty, 0 until it first sends
+static _Thread_local unsigned dirty_bit = 0;
+static atomic_uint sender_cnt;
+
+// Open files are capped at this so that the conn table stays small
+#define CONN_TABLE_MAX (1u << 20)
+// Files kept for listeners, epoll instances, rings and the like
+#define FD_RESERVE 64
+
+static size_t max_conns;
+// Connections whose fd is open, and the most there have been
+static atomic_size_t conn_cnt, conn_peak;
+static atomic_ulong conns_refused;
+// Set from the first refusal until a connection is admitted again
+static atomic_bool refusing;
+
+// Indexed by fd. Slots are filled by the reactors and emptied by the game
+// thread; the EMSG entries posted after filling a slot publish it to the game
+// thread, which is the only reader.
+static _Atomic(conn_t *) *conn_table = NULL;
+static size_t conn_table_len = 0;
+
+static void build_inet_addr(const char *address, uint32_t port,
+                            struct sockaddr_in *sin) {
+    struct in_addr saddr;
+    if (inet_aton(address, &saddr) == 0) {
+        ppanic("Invalid server IP address: %s", address);
+    }
+
+    sin->sin_addr = saddr;
+    sin->sin_port = htons(port);
+    sin->sin_family = AF_INET;
+}
+
+static int do_listen(const char *address, uint32_t port, bool nonblock,
+                     bool reuseport) {
+    struct sockaddr_in sin;
+    build_inet_addr(address, port, &sin);
+    int fd = socket(AF_INET,
+                    SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0),
+                    0);
+    if (fd == -1) {
+        ppanic("socket()");
+    }
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0) {
+        ppanic("setsockopt(SO_REUSEADDR)");
+    }
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        ppanic("setsockopt(SO_REUSEPORT)");
+    }
+
+    if (bind(fd, (const struct sockaddr *)&sin, sizeof(sin)) != 0) {
+        ppanic("bind()");
+    }
+    if (listen(fd, 4096) != 0) {
+        ppanic("listen()");
+    }
+
+    return fd;
+}
+
+/* With reuseport every reactor gets its own listener, and the kernel spreads
+ * incoming connections over them; otherwise all reactors share one. */
+static void open_listeners(const net_config_t *cfg, bool nonblock, int *fds) {
+    for (unsigned i = 0; i < cfg->reactors; ++i) {
+        if (cfg->reuseport || i == 0) {
+            fds[i] = do_listen(cfg->listen_addr, cfg->port, nonblock,
+                               cfg->reuseport);
+        } else {
+            fds[i] = fds[0];
+        }
+    }
+}
+
+static void close_listeners(const net_config_t *cfg, const int *fds) {
+    for (unsigned i = 0; i < cfg->reactors; ++i) {
+        if (cfg->reuseport || i == 0)
+            close(fds[i]);
+    }
+}
+
+void reactor_started(unsigned idx) {
+    if (!pin_reactors)
+        return;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(idx % max_(ncpu, 1), &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        log_warning("Cannot pin reactor %u: %s", idx, strerror(err));
+    } else {
+        log_info("Reactor %u pinned to CPU %ld", idx, idx % max_(ncpu, 1));
+    }
+}
+
+/* Raises the soft limit on open files as far as allowed, up to
+ * CONN_TABLE_MAX, and returns it. */
+static size_t raise_nofile_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+        ppanic("getrlimit()");
+    rlim_t want = min_(rl.rlim_max, (rlim_t)CONN_TABLE_MAX);
+    if (rl.rlim_cur != want) {
+        rlim_t old = rl.rlim_cur;
+        rl.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            log_warning("Cannot raise RLIMIT_NOFILE: %s", strerror(errno));
+            rl.rlim_cur = old;
+        }
+    }
+    log_info("File descriptor limit: %llu", (unsigned long long)rl.rlim_cur);
+    return rl.rlim_cur;
+}
+
+static pool_t entry_pool = POOL_INITIALIZER("queue_entry_t", queue_entry_t);
+
+queue_entry_t *queue_entry_new(int kind, int fd, message_t *msg) {
+    queue_entry_t *pq = pool_alloc(&entry_pool);
+    pq->kind = kind;
+    pq->fd = fd;
+    pq->msg = msg;
+    return pq;
+}
+
+void queue_entry_free(queue_entry_t *entry) { pool_free(&entry_pool, entry); }
+
+static void post_entry(int kind, int fd, message_t *msg) {
+    queue_entry_t *entry = queue_entry_new(kind, fd, msg);
+    if (kind != EMSG || dispatch == NULL || !dispatch(entry))
+        mpsc_add(incoming_queue, entry, true);
+}
+
+// Most encoded bytes in each size class of wbuf_t; frames are never longer
+// than a message_t
+static const size_t wbuf_class_cap[] = {64, 256, sizeof(message_t)};
+static pool_t wbuf_pools[] = {
+    POOL_INITIALIZER_SIZE("wbuf_t/64", sizeof(wbuf_t) + 64),
+    POOL_INITIALIZER_SIZE("wbuf_t/256", sizeof(wbuf_t) + 256),
+    POOL_INITIALIZER_SIZE("wbuf_t", sizeof(wbuf_t) + sizeof(message_t))};
+
+wbuf_t *wbuf_encode(const message_t *buf, uint32_t features) {
+    size_t sz = msg_wire_size(buf, features);
+    if (sz == 0)
+        return NULL;
+    assert(sz <= sizeof(message_t));
+    uint8_t cls = 0;
+    while (wbuf_class_cap[cls] < sz)
+        ++cls;
+    wbuf_t *wb = pool_alloc(&wbuf_pools[cls]);
+    wb->cls = cls;
+    atomic_init(&wb->refs, 1);
+    wb->kind = buf->head.kind;
+    wb->len = msg_encode(buf, wb->data, features);
+    assert(wb->len == sz);
+    return wb;
+}
+
+void wbuf_retain(wbuf_t *wb) { atomic_fetch_add(&wb->refs, 1); }
+
+void wbuf_release(wbuf_t *wb) {
+    if (atomic_fetch_sub(&wb->refs, 1) == 1)
+        pool_free(&wbuf_pools[wb->cls], wb);
+}
+
+void outq_push(outq_t *q, wbuf_t *wb) {
+    if (q->cnt == q->cap) {
+        size_t cap = max_(q->cap * 2, 8);
+        wbuf_t **p = xmalloc(cap * sizeof(*p));
+        for (size_t i = 0; i < q->cnt; ++i)
+            p[i] = q->bufs[(q->head + i) % q->cap];
+        free(q->bufs);
+        q->bufs = p;
+        q->head = 0;
+        q->cap = cap;
+    }
+    wbuf_retain(wb);
+    q->bufs[(q->head + q->cnt++) % q->cap] = wb;
+    q->bytes += wb->len;
+}
+
+size_t outq_iov(const outq_t *q, struct iovec *iov, size_t max) {
+    size_t n = min_(q->cnt, max);
+    for (size_t i = 0; i < n; ++i) {
+        wbuf_t *wb = q->bufs[(q->head + i) % q->cap];
+        size_t skip = i == 0 ? q->off : 0;
+        iov[i].iov_base = wb->data + skip;
+        iov[i].iov_len = wb->len - skip;
+    }
+    return n;
+}
+
+void outq_consume(outq_t *q, size_t n) {
+    assert(n <= q->bytes);
+    q->bytes -= n;
+    n += q->off;
+    while (q->cnt && n >= q->bufs[q->head]->len) {
+        n -= q->bufs[q->head]->len;
+        wbuf_release(q->bufs[q->head]);
+        q->head = (q->head + 1) % q->cap;
+        --q->cnt;
+    }
+    q->off = n;
+}
+
+void outq_clear(outq_t *q) {
+    for (size_t i = 0; i < q->cnt; ++i)
+        wbuf_release(q->bufs[(q->head + i) % q->cap]);
+    free(q->bufs);
+    memset(q, 0, sizeof(*q));
+}
+
+void conn_list_push(conn_list_t *l, conn_t *c) {
+    if (l->len == l->cap) {
+        l->cap = max_(l->cap * 2, 64);
+        conn_t **p = realloc(l->data, l->cap * sizeof(*p));
+        if (p == NULL)
+            ppanic("Memory allocation failed");
+        l->data = p;
+    }
+    l->data[l->len++] = c;
+}
+
+conn_t *conn_create(int fd, const struct sockaddr_in *sin, void *owner) {
+    conn_t *c = xcalloc(1, sizeof(*c));
+    c->fd = fd;
+    // Held by the conn table and the reactor
+    atomic_init(&c->refs, 2);
+    c->owner = owner;
+    pthread_mutex_init(&c->lock, NULL);
+    frame_reader_init(&c->rd);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &sin->sin_addr, ip, sizeof(ip));
+    snprintf(c->addr, sizeof(c->addr), "%s:%u", ip, ntohs(sin->sin_port));
+
+    assert((size_t)fd < conn_table_len);
+    assert(atomic_load_explicit(&conn_table[fd], memory_order_relaxed) ==
+           NULL);
+    atomic_store_explicit(&conn_table[fd], c, memory_order_release);
+    log_info("Accepted connection from %s", c->addr);
+    return c;
+}
+
+bool conn_admit_fd(int fd) {
+    size_t n = atomic_fetch_add(&conn_cnt, 1) + 1;
+    if (n <= max_conns) {
+        size_t peak = atomic_load_explicit(&conn_peak, memory_order_relaxed);
+        while (peak < n && !atomic_compare_exchange_weak(&conn_peak, &peak, n))
+            ;
+        if (atomic_load_explicit(&refusing, memory_order_relaxed))
+            atomic_store(&refusing, false);
+        return true;
+    }
+    atomic_fetch_sub(&conn_cnt, 1);
+    atomic_fetch_add_explicit(&conns_refused, 1, memory_order_relaxed);
+    if (!atomic_exchange(&refusing, true))
+        log_warning("%zu connections open; refusing new ones", max_conns);
+    // A reset tells the client at once and leaves no TIME_WAIT behind
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+    return false;
+}
+
+void conn_retain(conn_t *c) { atomic_fetch_add(&c->refs, 1); }
+
+void conn_release(conn_t *c) {
+    if (atomic_fetch_sub(&c->refs, 1) != 1)
+        return;
+    close(c->fd);
+    atomic_fetch_sub(&conn_cnt, 1);
+    pthread_mutex_destroy(&c->lock);
+    outq_clear(&c->out);
+    free(c->send_ctx);
+    free(c);
+}
+
+void *conn_recv_ptr(conn_t *c, size_t *want) {
+    return frame_reader_space(&c->rd, want);
+}
+
+void conn_shutdown(conn_t *c) {
+    if (!c->closed) {
+        c->closed = true;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+void conn_disconnected(conn_t *c) {
+    log_info("Disconnected from %s", c->addr);
+    // The fd stays open until the game thread calls net_close()
+    post_entry(EDISCONN, c->fd, NULL);
+    conn_release(c);
+}
+
+/* Only called by the game thread */
+static conn_t *conn_lookup(int fd) {
+    if (fd < 0 || (size_t)fd >= conn_table_len)
+        return NULL;
+    return atomic_load_explicit(&conn_table[fd], memory_order_acquire);
+}
+
+noreturn void net_run(const net_config_t *cfg, mpsc_queue_t *incoming) {
+    assert(cfg->reactors >= 1);
+    incoming_queue = incoming;
+    conn_table_len = raise_nofile_limit();
+    conn_table = xcalloc(conn_table_len, sizeof(*conn_table));
+    if (conn_table_len <= FD_RESERVE)
+        panic("Too few file descriptors: %zu", conn_table_len);
+    max_conns = conn_table_len - FD_RESERVE;
+    if (cfg->max_conns && cfg->max_conns < max_conns)
+        max_conns = cfg->max_conns;
+
+    const char *name = "epoll";
+    backend = &net_epoll_ops;
+#ifdef HAVE_IO_URING
+    if (cfg->backend == NET_URING) {
+        name = "io_uring";
+        backend = &net_uring_ops;
+    }
+#else
+    if (cfg->backend == NET_URING)
+        log_warning("Built without io_uring support; using epoll");
+#endif
+    pin_reactors = cfg->reuseport;
+    dispatch = cfg->dispatch;
+    conn_rate = cfg->conn_rate;
+    rate_exempt = cfg->rate_exempt;
+    throttle_reply = cfg->throttle_reply;
+    rate_limited = conn_rate.rate != 0;
+    for (int i = 0; i < MSG_MAX; ++i) {
+        kind_rate[i] = cfg->kind_rate[i];
+        rate_limited |= kind_rate[i].rate != 0;
+    }
+    outbuf_limit = cfg->outbuf_limit;
+    slow_policy = cfg->slow_policy;
+    // io_uring waits for readiness itself, so it gets blocking sockets
+    int *listen_fds = xcalloc(cfg->reactors, sizeof(*listen_fds));
+    open_listeners(cfg, backend == &net_epoll_ops, listen_fds);
+    if (!backend->init(cfg, listen_fds)) {
+        log_warning("The %s backend is not available; falling back to epoll",
+                    name);
+        close_listeners(cfg, listen_fds);
+        name = "epoll";
+        backend = &net_epoll_ops;
+        open_listeners(cfg, true, listen_fds);
+        if (!backend->init(cfg, listen_fds))
+            panic("Cannot initialize the network backend");
+    }
+    log_info("Listening at %s:%u with %u %s reactor(s)%s, up to %zu "
+             "connections...",
+             cfg->listen_addr, cfg->port, cfg->reactors, name,
+             cfg->reuseport ? " on separate listeners" : "", max_conns);
+    backend->run();
+    abort();
+}
+
+/* Whether sz more bytes of a kind message may be queued on c; applies the
+ * slow client policy if not. c->lock must be held. */
+static bool conn_admit(conn_t *c, msg_kind_t kind, size_t sz) {
+    size_t queued = c->out.bytes;
+    if (queued + sz <= outbuf_limit)
+        return true;
+    if (slow_policy == SLOW_DROP_ROSTER) {
+        if (kind == UCHANGE) {
+            if (c->dropped++ == 0)
+                log_warning("%s is slow; dropping roster updates", c->addr);
+            return false;
+        }
+        if (queued + sz <= 2 * (size_t)outbuf_limit)
+            return true;
+    }
+    log_warning("%s is too slow (%zu bytes queued); disconnecting", c->addr,
+                queued);
+    conn_shutdown(c);
+    return false;
+}
+
+/* Queues a reference to wb on c, without flushing it. */
+static bool conn_enqueue(conn_t *c, wbuf_t *wb) {
+    pthread_mutex_lock(&c->lock);
+    bool ok = !c->closed && conn_admit(c, wb->kind, wb->len);
+    if (ok) {
+        outq_push(&c->out, wb);
+        ++c->msgs_out;
+        c->bytes_out += wb->len;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+}
+
+/* Queues buf on c from its reactor, which flushes c itself. */
+static bool conn_reply(conn_t *c, const message_t *buf) {
+    wbuf_t *wb = wbuf_encode(buf, c->features);
+    if (wb == NULL)
+        return false;
+    bool ok = conn_enqueue(c, wb);
+    wbuf_release(wb);
+    return ok;
+}
+
+/* Token buckets are kept as the time at which they are full again, tat (the
+ * "theoretical arrival time" of GCRA). A message passes if that is at most
+ * burst - 1 intervals away, and moves it one interval on. */
+static bool rate_allows(uint64_t tat, const rate_limit_t *lim, uint64_t now) {
+    if (lim->rate == 0)
+        return true;
+    uint64_t interval = 1000000000ull / lim->rate;
+    return max_(tat, now) - now <= (max_(lim->burst, 1) - 1) * interval;
+}
+
+static void rate_take(uint64_t *tat, const rate_limit_t *lim, uint64_t now) {
+    if (lim->rate)
+        *tat = max_(*tat, now) + 1000000000ull / lim->rate;
+}
+
+/* Whether c may send msg at now; counts it as dropped if not. */
+static bool conn_rate_admit(conn_t *c, const message_t *msg, uint64_t now) {
+    msg_kind_t kind = msg->head.kind;
+    if (rate_exempt && rate_exempt(msg))
+        return true;
+    if (rate_allows(c->rate_tat_all, &conn_rate, now) &&
+        rate_allows(c->rate_tat[kind], &kind_rate[kind], now)) {
+        rate_take(&c->rate_tat_all, &conn_rate, now);
+        rate_take(&c->rate_tat[kind], &kind_rate[kind], now);
+        return true;
+    }
+    if (c->throttled++ == 0)
+        log_warning("%s sends too fast; dropping messages", c->addr);
+    atomic_fetch_add_explicit(&throttled[kind], 1, memory_order_relaxed);
+    return false;
+}
+
+int conn_received(conn_t *c, size_t cnt) {
+    frame_reader_filled(&c->rd, cnt);
+    message_t msg;
+    int res, frames = 0;
+    uint64_t now = 0;
+    if (rate_limited) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        now = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+    bool replied = false;
+    while ((res = frame_reader_next(&c->rd, &msg)) > 0) {
+        ++frames;
+        if (rate_limited && !conn_rate_admit(c, &msg, now)) {
+            message_t reply;
+            if (throttle_reply && throttle_reply(&msg, &reply))
+                replied |= conn_reply(c, &reply);
+            continue;
+        }
+        log_info("Received packet; enqueueing it...");
+        post_entry(EMSG, c->fd, msg_dup(&msg));
+    }
+    c->frames_in += frames;
+    if (replied) {
+        // Reactors have no dirty bit of their own; flush c alone
+        conn_retain(c);
+        conn_list_t one = {.data = &c, .len = 1, .cap = 1};
+        backend->flush(&one);
+    }
+    if (res < 0) {
+        log_error("Received corrupted packet from %s; must shutdown...",
+                  c->addr);
+        return -1;
+    }
+    return frames;
+}
+
+/* Queues a reference to wb on c. */
+static int conn_send(conn_t *c, wbuf_t *wb) {
+    if (!conn_enqueue(c, wb))
+        return -1;
+    if (dirty_bit == 0) {
+        unsigned idx = atomic_fetch_add(&sender_cnt, 1);
+        if (idx >= sizeof(dirty_bit) * CHAR_BIT)
+            panic("Too many sending threads");
+        dirty_bit = 1u << idx;
+    }
+    // Only this thread sets or clears its bit
+    if (!(atomic_load_explicit(&c->dirty, memory_order_relaxed) & dirty_bit)) {
+        atomic_fetch_or_explicit(&c->dirty, dirty_bit, memory_order_relaxed);
+        conn_retain(c);
+        conn_list_push(&dirty_conns, c);
+    }
+    return 0;
+}
+
+int net_send(int fd, const message_t *buf) {
+    return net_send_conn(conn_lookup(fd), buf);
+}
+
+conn_t *net_conn(int fd) {
+    conn_t *c = conn_lookup(fd);
+    if (c)
+        conn_retain(c);
+    return c;
+}
+
+int net_send_conn(conn_t *c, const message_t *buf) {
+    if (c == NULL)
+        return -1;
+    wbuf_t *wb = wbuf_encode(buf, c->features);
+    if (wb == NULL)
+        return -1;
+    int res = conn_send(c, wb);
+    wbuf_release(wb);
+    return res;
+}
+
+void shared_msg_init(shared_msg_t *sm, const message_t *msg) {
+    sm->msg = msg;
+    memset(sm->wire, 0, sizeof(sm->wire));
+}
+
+void shared_msg_done(shared_msg_t *sm) {
+    for (int i = 0; i < ARRAY_SIZE(sm->wire); ++i) {
+        if (sm->wire[i])
+            wbuf_release(sm->wire[i]);
+    }
+}
+
+int net_send_shared(int fd, shared_msg_t *sm) {
+    return net_send_shared_conn(conn_lookup(fd), sm);
+}
+
+int net_send_shared_conn(conn_t *c, shared_msg_t *sm) {
+    if (c == NULL)
+        return -1;
+    // The features that change the encoding pick the form
+    unsigned form = (c->features & MSG_FEAT_COMPACT ? 1 : 0) |
+                    (c->features & MSG_FEAT_ID32 ? 2 : 0);
+    if (sm->wire[form] == NULL) {
+        sm->wire[form] = wbuf_encode(
+            sm->msg, c->features & (MSG_FEAT_COMPACT | MSG_FEAT_ID32));
+        if (sm->wire[form] == NULL)
+            return -1;
+    }
+    return conn_send(c, sm->wire[form]);
+}
+
+void net_set_features(int fd, uint32_t features) {
+    conn_t *c = conn_lookup(fd);
+    if (c)
+        c->features = features;
+}
+
+void net_set_user(int fd, void *user) {
+    conn_t *c = conn_lookup(fd);
+    if (c)
+        c->user = user;
+}
+
+void *net_user(int fd) {
+    conn_t *c = conn_lookup(fd);
+    return c ? c->user : NULL;
+}
+
+void net_flush(void) {
+    if (dirty_conns.len == 0)
+        return;
+    for (size_t i = 0; i < dirty_conns.len; ++i) {
+        atomic_fetch_and_explicit(&dirty_conns.data[i]->dirty, ~dirty_bit,
+                                  memory_order_relaxed);
+    }
+    backend->flush(&dirty_conns);
+}
+
+void net_close(int fd) {
+    conn_t *c = conn_lookup(fd);
+    if (c == NULL)
+        return;
+    // Emptied before the fd can be closed and handed out again
+    atomic_store_explicit(&conn_table[fd], NULL, memory_order_relaxed);
+
+    // Aborts in-flight operations; the fd is closed with the last reference
+    pthread_mutex_lock(&c->lock);
+    conn_shutdown(c);
+    log_info("Closing %s: %llu frames in, %llu messages (%llu bytes) out, "
+             "%u dropped, %u throttled",
+             c->addr, (unsigned long long)c->frames_in,
+             (unsigned long long)c->msgs_out,
+             (unsigned long long)c->bytes_out, c->dropped, c->throttled);
+    pthread_mutex_unlock(&c->lock);
+    conn_release(c);
+}
+
+static const char *const kind_names[MSG_MAX] = {
+#define kind_name(KIND, _) [KIND] = #KIND,
+    for_each_msg_kind(kind_name)
+#undef kind_name
+};
+
+void net_log_stats(void) {
+    log_info("Connections: %zu open, %zu peak, %zu allowed, %lu refused",
+             atomic_load(&conn_cnt), atomic_load(&conn_peak), max_conns,
+             atomic_load(&conns_refused));
+    for (int i = 0; i < MSG_MAX; ++i) {
+        unsigned long n = atomic_load(&throttled[i]);
+        if (n)
+            log_info("Throttled %s: %lu", kind_names[i], n);
+    }
+}
@@ -0,0 +1,235 @@
+#ifndef __GAME_SERVER_NET_H
+#define __GAME_SERVER_NET_H
+#define __IS_SERVER
+#include "lib/common.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+typedef struct queue_entry_t {
+    // The network layer only posts EMSG and EDISCONN; the others are passed
+    // between the server's own threads
+    enum { EMSG, EDISCONN, ETICK, EBATTLE, EFORFEIT, EBATTLE_END } kind;
+    int fd;
+    union {
+        message_t *msg;
+        // EBATTLE and EBATTLE_END
+        challenge_t *ch;
+        // EFORFEIT: the user who gives up the battle chid
+        struct {
+            uint32_t chid, user;
+        } forfeit;
+    };
+} queue_entry_t;
+
+/* Entries come from a pool; msg is not freed with the entry. */
+queue_entry_t *queue_entry_new(int kind, int fd, message_t *msg);
+void queue_entry_free(queue_entry_t *entry);
+
+typedef enum net_backend_t { NET_EPOLL, NET_URING } net_backend_t;
+
+/* What to do with a client whose outbound buffer is full */
+typedef enum slow_policy_t {
+    SLOW_DISCONNECT,
+    // Drop UCHANGE's; other messages may use up to twice the limit
+    SLOW_DROP_ROSTER
+} slow_policy_t;
+
+/* A token bucket: rate messages a second on average, and up to burst at
+ * once. A rate of 0 means no limit. */
+typedef struct rate_limit_t {
+    uint32_t rate, burst;
+} rate_limit_t;
+
+typedef struct net_config_t {
+    const char *listen_addr;
+    uint32_t port;
+    net_backend_t backend;
+    // Number of reactor threads (epoll instances or rings)
+    uint32_t reactors;
+    // Submission queue entries of each io_uring; the completion queue has
+    // twice as many
+    uint32_t ring_entries;
+    // Give every reactor its own SO_REUSEPORT listener and pin it to a core
+    bool reuseport;
+    // Bytes that may be queued for a client before slow_policy applies
+    uint32_t outbuf_limit;
+    slow_policy_t slow_policy;
+    // Connections open at once, beyond which new ones are reset right after
+    // they are accepted; 0 means as many as the open file limit allows
+    uint32_t max_conns;
+    // Messages each client may send in all and of each kind; the reactors
+    // drop what is over either limit before it is posted. Messages for
+    // which rate_exempt returns true count against neither and are never
+    // dropped.
+    rate_limit_t conn_rate;
+    rate_limit_t kind_rate[MSG_MAX];
+    bool (*rate_exempt)(const message_t *msg);
+    // If set, fills in the reply to a dropped message and returns true, or
+    // returns false if the message goes unanswered
+    bool (*throttle_reply)(const message_t *msg, message_t *reply);
+    // If set, offered each EMSG entry by the reactor that decoded it;
+    // returns true if it took the entry, which goes to the incoming queue
+    // otherwise
+    bool (*dispatch)(queue_entry_t *entry);
+} net_config_t;
+
+/* Opens the listening socket and runs the reactors; decoded messages and
+ * disconnections are posted to incoming as queue_entry_t's. Never returns. */
+noreturn void net_run(const net_config_t *cfg, mpsc_queue_t *incoming);
+/* buf should be in host byte order. The message is queued on the connection
+ * and written out by net_flush() or when the socket becomes writable; this
+ * never blocks. Returns -1 if the message was dropped. Only the game thread
+ * sends by fd. */
+int net_send(int fd, const message_t *buf);
+/* Takes a reference to the connection at fd, or returns NULL. Any thread may
+ * send on it with net_send_conn() until it drops the reference with
+ * conn_release(); once the connection is closed, sends fail. */
+struct conn_t *net_conn(int fd);
+int net_send_conn(struct conn_t *c, const message_t *buf);
+/* A message to be sent to many connections. It is encoded once for each wire
+ * form that the receivers need, and the encodings are shared. */
+typedef struct shared_msg_t {
+    const message_t *msg;
+    // Indexed by the wire form: bit 0 is set if it is compact and bit 1 if
+    // ids take 32 bits
+    struct wbuf_t *wire[4];
+} shared_msg_t;
+void shared_msg_init(shared_msg_t *sm, const message_t *msg);
+void shared_msg_done(shared_msg_t *sm);
+/* Like net_send(), but only queues a reference to the encoded message. */
+int net_send_shared(int fd, shared_msg_t *sm);
+/* Like net_send_conn(), for a shared message; sm must not be shared between
+ * threads. */
+int net_send_shared_conn(struct conn_t *c, shared_msg_t *sm);
+/* Sets the MSG_FEAT_* the client at fd announced in its JOIN. */
+void net_set_features(int fd, uint32_t features);
+/* Attaches the game thread's user to the connection at fd until it is
+ * closed; NULL detaches it. */
+void net_set_user(int fd, void *user);
+/* The user attached to fd, or NULL. O(1). */
+void *net_user(int fd);
+/* Starts writing everything the calling thread queued so far. */
+void net_flush(void);
+/* Releases fd after its EDISCONN entry has been handled. */
+void net_close(int fd);
+/* Logs how many connections are open, how many were refused and how many
+ * messages the rate limits dropped. */
+void net_log_stats(void);
+
+/* Internals shared by the backends */
+
+/* A message encoded to network order, shared by any number of connections */
+typedef struct wbuf_t {
+    atomic_uint refs;
+    msg_kind_t kind;
+    // Size class the buffer came from
+    uint8_t cls;
+    uint32_t len;
+    char data[];
+} wbuf_t;
+
+/* Returns a wbuf_t with one reference, or NULL if buf is invalid. */
+wbuf_t *wbuf_encode(const message_t *buf, uint32_t features);
+void wbuf_retain(wbuf_t *wb);
+void wbuf_release(wbuf_t *wb);
+
+// Most segments written by one system call
+#define SEND_IOV 32
+
+/* FIFO of wbuf_t's waiting to be sent; off bytes of the first one are sent
+ * already and bytes counts what is left. */
+typedef struct outq_t {
+    wbuf_t **bufs;
+    size_t head, cnt, cap;
+    size_t off, bytes;
+} outq_t;
+
+typedef struct conn_t {
+    int fd;
+    // One reference is held by the conn table, one by the reactor until it
+    // sees the end of the stream, and one by each in-flight operation.
+    atomic_uint refs;
+    char addr[32];
+    // Reactor owning the connection
+    void *owner;
+    // Receive state, only touched by the owner
+    frame_reader_t rd;
+    // Send state, protected by lock. sending means that a send is in flight
+    // (io_uring) or that the socket must become writable first (epoll).
+    pthread_mutex_t lock;
+    outq_t out;
+    bool sending, closed;
+    // Backend specific send state, freed with c
+    void *send_ctx;
+    // Messages dropped by SLOW_DROP_ROSTER
+    uint32_t dropped;
+    // Messages and bytes queued, protected by lock
+    uint64_t msgs_out, bytes_out;
+    // Frames received, only touched by the owner
+    uint64_t frames_in;
+    // Rate limit state, only touched by the owner: when the bucket of all
+    // messages and those of each kind are full again, see rate_allows()
+    uint64_t rate_tat_all, rate_tat[MSG_MAX];
+    // Messages dropped by the rate limits
+    uint32_t throttled;
+    // Bit i is set while the connection is on the dirty list of the i-th
+    // thread that sent something
+    atomic_uint dirty;
+    // Only touched by the game thread, and read by others after it hands
+    // the connection over
+    uint32_t features;
+    void *user;
+} conn_t;
+
+typedef struct conn_list_t {
+    conn_t **data;
+    size_t len, cap;
+} conn_list_t;
+
+typedef struct net_backend_ops_t {
+    /* listen_fds holds the listening socket of each reactor. Returns false if
+     * the backend is not supported here. */
+    bool (*init)(const net_config_t *cfg, const int *listen_fds);
+    /* Never returns */
+    void (*run)(void);
+    /* Starts writing out the connections in dirty, which hold a reference
+     * each. Must drop the references and empty the list. May be called by
+     * several threads at once, each with its own list. */
+    void (*flush)(conn_list_t *dirty);
+} net_backend_ops_t;
+
+extern const net_backend_ops_t net_epoll_ops;
+#ifdef HAVE_IO_URING
+extern const net_backend_ops_t net_uring_ops;
+#endif
+
+/* Called by each reactor thread when it starts. */
+void reactor_started(unsigned idx);
+/* Counts a connection just accepted at fd against the limit. Returns false
+ * if it is over, having reset and closed fd. */
+bool conn_admit_fd(int fd);
+conn_t *conn_create(int fd, const struct sockaddr_in *sin, void *owner);
+void conn_retain(conn_t *c);
+/* Closes the fd and frees c when the last reference is gone. */
+void conn_release(conn_t *c);
+/* Where and how many bytes to receive next. */
+void *conn_recv_ptr(conn_t *c, size_t *want);
+/* Accounts for cnt bytes received at conn_recv_ptr() and posts every complete
+ * frame within the rate limits. Returns the number of frames decoded, or -1
+ * if the stream is corrupted. */
+int conn_received(conn_t *c, size_t cnt);
+/* Posts EDISCONN for c and drops the reactor's reference. */
+void conn_disconnected(conn_t *c);
+/* Shuts down c so that its reactor sees the end of the stream. c->lock must
+ * be held. */
+void conn_shutdown(conn_t *c);
+void conn_list_push(conn_list_t *l, conn_t *c);
+/* Takes a new reference to wb. */
+void outq_push(outq_t *q, wbuf_t *wb);
+/* Fills at most max iovecs with the unsent bytes; returns the count. */
+size_t outq_iov(const outq_t *q, struct iovec *iov, size_t max);
+/* Marks n bytes as sent, dropping finished wbuf_t's. */
+void outq_consume(outq_t *q, size_t n);
+void outq_clear(outq_t *q);
+#endif
@@ -0,0 +1,186 @@
+#include "net.h"
+#include <sys/epoll.h>
+
+#define EPOLL_BATCH 256
+// Connections accepted per listener wakeup
+#define ACCEPT_BATCH 64
+// Frames decoded per readiness event before moving on to other connections
+#define READ_BATCH 16
+
+typedef struct reactor_t {
+    int epfd;
+    int listen_fd;
+    unsigned idx;
+} reactor_t;
+
+static reactor_t *reactors = NULL;
+static unsigned reactor_cnt = 0;
+// Identifies the listening socket in epoll_event.data.ptr
+static char listener_tag;
+
+static void conn_drop(reactor_t *r, conn_t *c) {
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    conn_disconnected(c);
+}
+
+/* Reads whatever is available on c. Returns false if c must be dropped. */
+static bool conn_read(conn_t *c) {
+    for (int frames = 0; frames < READ_BATCH;) {
+        size_t want;
+        void *p = conn_recv_ptr(c, &want);
+        ssize_t cnt = recv(c->fd, p, want, 0);
+        if (cnt == 0) {
+            return false;
+        } else if (cnt < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            if (errno == EINTR)
+                continue;
+            log_error("Receiving from %s: %s", c->addr, strerror(errno));
+            return false;
+        }
+        int res = conn_received(c, cnt);
+        if (res < 0)
+            return false;
+        frames += res;
+        // A short read drained the socket; skip the recv() that would fail
+        // with EAGAIN
+        if ((size_t)cnt < want)
+            return true;
+    }
+    return true;
+}
+
+/* Writes as much of c->out as the socket takes. Returns false if bytes
+ * remain. c->lock must be held. */
+static bool conn_write(conn_t *c) {
+    struct iovec iov[SEND_IOV];
+    while (!c->closed && c->out.cnt) {
+        struct msghdr mh = {.msg_iov = iov,
+                            .msg_iovlen = outq_iov(&c->out, iov, SEND_IOV)};
+        ssize_t cnt = sendmsg(c->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (cnt < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            if (errno == EINTR)
+                continue;
+            // The reader sees the error as well and disconnects
+            log_info("Sending to %s: %s", c->addr, strerror(errno));
+            c->closed = true;
+            break;
+        }
+        outq_consume(&c->out, cnt);
+    }
+    return true;
+}
+
+/* (Dis)arms EPOLLOUT for c. c->lock must be held. */
+static void conn_want_write(conn_t *c, bool on) {
+    reactor_t *r = c->owner;
+    struct epoll_event ev = {.events = EPOLLIN | (on ? EPOLLOUT : 0),
+                             .data.ptr = c};
+    // Fails harmlessly if the reactor has already dropped c
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->sending = on;
+}
+
+static void conn_writable(conn_t *c) {
+    pthread_mutex_lock(&c->lock);
+    if (c->sending && conn_write(c))
+        conn_want_write(c, false);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void accept_conns(reactor_t *r) {
+    for (int i = 0; i < ACCEPT_BATCH; ++i) {
+        struct sockaddr_in sin;
+        socklen_t addrlen = sizeof(sin);
+        int fd = accept4(r->listen_fd, (struct sockaddr *)&sin, &addrlen,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                log_error("accept(): %s", strerror(errno));
+            return;
+        }
+        if (!conn_admit_fd(fd))
+            continue;
+
+        conn_t *c = conn_create(fd, &sin, r);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            log_error("epoll_ctl(): %s", strerror(errno));
+            conn_disconnected(c);
+            continue;
+        }
+    }
+}
+
+static void *reactor_main(void *parg) {
+    reactor_t *r = parg;
+    struct epoll_event evs[EPOLL_BATCH];
+    reactor_started(r->idx);
+    while (1) {
+        int n = epoll_wait(r->epfd, evs, EPOLL_BATCH, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            ppanic("epoll_wait()");
+        }
+        for (int i = 0; i < n; ++i) {
+            if (evs[i].data.ptr == &listener_tag) {
+                accept_conns(r);
+            } else {
+                conn_t *c = evs[i].data.ptr;
+                if (evs[i].events & EPOLLOUT)
+                    conn_writable(c);
+                if ((evs[i].events & ~EPOLLOUT) && !conn_read(c))
+                    conn_drop(r, c);
+            }
+        }
+    }
+    return 0;
+}
+
+static bool epoll_init(const net_config_t *cfg, const int *listen_fds) {
+    reactor_cnt = cfg->reactors;
+    reactors = xcalloc(reactor_cnt, sizeof(*reactors));
+    for (unsigned i = 0; i < reactor_cnt; ++i) {
+        reactor_t *r = &reactors[i];
+        r->idx = i;
+        r->listen_fd = listen_fds[i];
+        r->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (r->epfd == -1)
+            ppanic("epoll_create1()");
+        // Only one of the reactors is woken up for each incoming connection
+        // if they share the listener
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                 .data.ptr = &listener_tag};
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listen_fd, &ev) != 0)
+            ppanic("epoll_ctl()");
+    }
+    return true;
+}
+
+static void epoll_run(void) {
+    for (unsigned i = 1; i < reactor_cnt; ++i)
+        xthread_create(reactor_main, &reactors[i]);
+    reactor_main(&reactors[0]);
+    abort();
+}
+
+/* Writes directly from the game thread; only what the socket does not take
+ * right away is left to the reactor. */
+static void epoll_flush(conn_list_t *dirty) {
+    for (size_t i = 0; i < dirty->len; ++i) {
+        conn_t *c = dirty->data[i];
+        pthread_mutex_lock(&c->lock);
+        if (!c->sending && !conn_write(c))
+            conn_want_write(c, true);
+        pthread_mutex_unlock(&c->lock);
+        conn_release(c);
+    }
+    dirty->len = 0;
+}
+
+const net_backend_ops_t net_epoll_ops = {
+    .init = epoll_init, .run = epoll_run, .flush = epoll_flush};
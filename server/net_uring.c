@@ -0,0 +1,411 @@
+#include "net.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Operation kinds, stored in the low bits of user_data next to the conn_t
+enum { OP_ACCEPT = 1, OP_RECV, OP_SEND };
+#define OP_MASK ((uintptr_t)3)
+
+typedef struct ring_t {
+    int fd;
+    int listen_fd;
+    unsigned idx;
+    // Protects the submission queue, which is filled by the reactor and by
+    // the threads that flush sends
+    pthread_mutex_t sq_lock;
+    unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+    struct io_uring_sqe *sqes;
+    // Entries published to the kernel but not yet passed to io_uring_enter()
+    unsigned unsubmitted;
+    // Operations that found the submission queue full, under sq_lock. The
+    // reactor starts them once it has reaped completions. Deferred sends
+    // hold the reference and the sending flag their send will have.
+    bool accept_deferred;
+    conn_list_t recv_deferred, send_deferred;
+    // Completion queue, only reaped by the reactor
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    // Target of the outstanding accept
+    struct sockaddr_in accept_addr;
+    socklen_t accept_len;
+} ring_t;
+
+static ring_t *rings = NULL;
+static unsigned ring_cnt = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static bool ring_setup(ring_t *r, unsigned idx, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        log_warning("io_uring_setup(): %s", strerror(errno));
+        return false;
+    }
+    // SENDMSG/RECV and in-kernel polling for readiness
+    const unsigned needed = IORING_FEAT_NODROP | IORING_FEAT_FAST_POLL;
+    if ((p.features & needed) != needed) {
+        log_warning("io_uring lacks needed features (%#x)", p.features);
+        close(r->fd);
+        return false;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_sz = cq_sz = max_(sq_sz, cq_sz);
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        ppanic("mmap(IORING_OFF_SQ_RING)");
+    char *cq = sq;
+    if (!single) {
+        cq = mmap(NULL, cq_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            ppanic("mmap(IORING_OFF_CQ_RING)");
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        ppanic("mmap(IORING_OFF_SQES)");
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->unsubmitted = 0;
+    r->idx = idx;
+    pthread_mutex_init(&r->sq_lock, NULL);
+    return true;
+}
+
+/* Passes published entries to the kernel. sq_lock must be held. */
+static void ring_submit(ring_t *r) {
+    while (r->unsubmitted) {
+        int n = sys_io_uring_enter(r->fd, r->unsubmitted, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // The completion queue is backed up; the reactor submits the rest
+            // after reaping
+            if (errno == EBUSY || errno == EAGAIN)
+                return;
+            ppanic("io_uring_enter()");
+        }
+        r->unsubmitted -= n;
+    }
+}
+
+/* sq_lock must be held. The entry is published by ring_push(). */
+static struct io_uring_sqe *ring_get_sqe(ring_t *r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+        r->sq_entries) {
+        ring_submit(r);
+        if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+            r->sq_entries)
+            return NULL;
+    }
+    unsigned idx = tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void ring_push(ring_t *r) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+    ++r->unsubmitted;
+}
+
+/* The ring_try_* functions queue an operation, or return false if the
+ * submission queue is full. sq_lock must be held. */
+
+static bool ring_try_accept(ring_t *r) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    if (sqe == NULL)
+        return false;
+    r->accept_len = sizeof(r->accept_addr);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->addr = (uintptr_t)&r->accept_addr;
+    sqe->addr2 = (uintptr_t)&r->accept_len;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+    ring_push(r);
+    return true;
+}
+
+/* Only called by the reactor, which owns the receive state of c. */
+static bool ring_try_recv(ring_t *r, conn_t *c) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    if (sqe == NULL)
+        return false;
+    size_t want;
+    void *p = conn_recv_ptr(c, &want);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)p;
+    sqe->len = want;
+    sqe->user_data = (uintptr_t)c | OP_RECV;
+    ring_push(r);
+    return true;
+}
+
+static void ring_prep_accept(ring_t *r) {
+    pthread_mutex_lock(&r->sq_lock);
+    if (!ring_try_accept(r))
+        r->accept_deferred = true;
+    pthread_mutex_unlock(&r->sq_lock);
+}
+
+/* The recv holds the reactor's reference to c. */
+static void ring_prep_recv(ring_t *r, conn_t *c) {
+    pthread_mutex_lock(&r->sq_lock);
+    if (!ring_try_recv(r, c))
+        conn_list_push(&r->recv_deferred, c);
+    pthread_mutex_unlock(&r->sq_lock);
+}
+
+/* Kept alive with the connection since the kernel may read it until the
+ * send completes */
+typedef struct send_ctx_t {
+    struct msghdr hdr;
+    struct iovec iov[SEND_IOV];
+} send_ctx_t;
+
+/* c->lock must be held as well. */
+static bool ring_try_send(ring_t *r, conn_t *c) {
+    struct io_uring_sqe *sqe = ring_get_sqe(r);
+    if (sqe == NULL)
+        return false;
+    if (c->send_ctx == NULL)
+        c->send_ctx = xcalloc(1, sizeof(send_ctx_t));
+    send_ctx_t *ctx = c->send_ctx;
+    ctx->hdr.msg_iov = ctx->iov;
+    ctx->hdr.msg_iovlen = outq_iov(&c->out, ctx->iov, SEND_IOV);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uintptr_t)&ctx->hdr;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t)c | OP_SEND;
+    ring_push(r);
+    return true;
+}
+
+/* Starts the next send of c if there is anything to send and no send is in
+ * flight or deferred. Both sq_lock and c->lock must be held. */
+static void ring_prep_send(ring_t *r, conn_t *c) {
+    if (c->sending || c->closed || c->out.cnt == 0)
+        return;
+    c->sending = true;
+    conn_retain(c);
+    if (!ring_try_send(r, c))
+        conn_list_push(&r->send_deferred, c);
+}
+
+/* Starts what ring_try_* found no room for, in order, until the queue is
+ * full again. sq_lock must be held. */
+static void ring_retry_deferred(ring_t *r) {
+    if (r->accept_deferred) {
+        if (!ring_try_accept(r))
+            return;
+        r->accept_deferred = false;
+    }
+    conn_list_t *l = &r->recv_deferred;
+    size_t n = 0;
+    while (n < l->len && ring_try_recv(r, l->data[n]))
+        ++n;
+    memmove(l->data, l->data + n, (l->len - n) * sizeof(*l->data));
+    l->len -= n;
+    if (l->len)
+        return;
+
+    l = &r->send_deferred;
+    for (n = 0; n < l->len; ++n) {
+        conn_t *c = l->data[n];
+        pthread_mutex_lock(&c->lock);
+        // Nothing to send any more: drop what the send would have held
+        bool drop = c->closed || c->out.cnt == 0, started = false;
+        if (drop)
+            c->sending = false;
+        else
+            started = ring_try_send(r, c);
+        pthread_mutex_unlock(&c->lock);
+        if (drop)
+            conn_release(c);
+        else if (!started)
+            break;
+    }
+    memmove(l->data, l->data + n, (l->len - n) * sizeof(*l->data));
+    l->len -= n;
+}
+
+static bool ring_has_deferred(const ring_t *r) {
+    return r->accept_deferred || r->recv_deferred.len || r->send_deferred.len;
+}
+
+/* Starts sends for all connections in l with a single io_uring_enter(), and
+ * drops the references held by l. */
+static void ring_kick(ring_t *r, conn_list_t *l) {
+    if (l->len == 0)
+        return;
+    pthread_mutex_lock(&r->sq_lock);
+    for (size_t i = 0; i < l->len; ++i) {
+        conn_t *c = l->data[i];
+        pthread_mutex_lock(&c->lock);
+        ring_prep_send(r, c);
+        pthread_mutex_unlock(&c->lock);
+    }
+    ring_submit(r);
+    pthread_mutex_unlock(&r->sq_lock);
+    for (size_t i = 0; i < l->len; ++i)
+        conn_release(l->data[i]);
+    l->len = 0;
+}
+
+static void handle_accept(ring_t *r, int res) {
+    if (res >= 0) {
+        if (conn_admit_fd(res))
+            ring_prep_recv(r, conn_create(res, &r->accept_addr, r));
+    } else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED) {
+        log_error("accept(): %s", strerror(-res));
+    }
+    ring_prep_accept(r);
+}
+
+static void handle_recv(ring_t *r, conn_t *c, int res) {
+    if (res == -EINTR || res == -EAGAIN) {
+        ring_prep_recv(r, c);
+        return;
+    }
+    if (res < 0)
+        log_error("Receiving from %s: %s", c->addr, strerror(-res));
+    if (res <= 0 || conn_received(c, res) < 0) {
+        conn_disconnected(c);
+        return;
+    }
+    ring_prep_recv(r, c);
+}
+
+static void handle_send(conn_t *c, int res, conn_list_t *kick) {
+    pthread_mutex_lock(&c->lock);
+    c->sending = false;
+    if (res >= 0) {
+        outq_consume(&c->out, res);
+    } else if (res != -EINTR && res != -EAGAIN) {
+        // The reader sees the error as well and disconnects
+        log_info("Sending to %s: %s", c->addr, strerror(-res));
+        c->closed = true;
+    }
+    bool more = !c->closed && c->out.cnt > 0;
+    pthread_mutex_unlock(&c->lock);
+    if (more) {
+        // The send's reference is handed over to the kick list
+        conn_list_push(kick, c);
+    } else {
+        conn_release(c);
+    }
+}
+
+static void *ring_main(void *parg) {
+    ring_t *r = parg;
+    conn_list_t kick = {0};
+    reactor_started(r->idx);
+    ring_prep_accept(r);
+    while (1) {
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            uintptr_t data = cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+
+            conn_t *c = (conn_t *)(data & ~OP_MASK);
+            switch (data & OP_MASK) {
+            case OP_ACCEPT:
+                handle_accept(r, res);
+                break;
+            case OP_RECV:
+                handle_recv(r, c, res);
+                break;
+            case OP_SEND:
+                handle_send(c, res, &kick);
+                break;
+            }
+        }
+        ring_kick(r, &kick);
+        pthread_mutex_lock(&r->sq_lock);
+        ring_retry_deferred(r);
+        ring_submit(r);
+        // Operations still waiting for room must not wait for completions
+        // that may never come
+        unsigned wait = ring_has_deferred(r) ? 0 : 1;
+        pthread_mutex_unlock(&r->sq_lock);
+
+        if (sys_io_uring_enter(r->fd, 0, wait, IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR && errno != EBUSY)
+            ppanic("io_uring_enter()");
+    }
+    return 0;
+}
+
+static bool uring_init(const net_config_t *cfg, const int *listen_fds) {
+    ring_cnt = cfg->reactors;
+    rings = xcalloc(ring_cnt, sizeof(*rings));
+    for (unsigned i = 0; i < ring_cnt; ++i) {
+        rings[i].listen_fd = listen_fds[i];
+        if (!ring_setup(&rings[i], i, cfg->ring_entries)) {
+            for (unsigned j = 0; j < i; ++j)
+                close(rings[j].fd);
+            free(rings);
+            rings = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+static void uring_run(void) {
+    for (unsigned i = 1; i < ring_cnt; ++i)
+        xthread_create(ring_main, &rings[i]);
+    ring_main(&rings[0]);
+    abort();
+}
+
+/* Every ring gets all of its sends since the last flush in one submission. */
+static void uring_flush(conn_list_t *dirty) {
+    // The calling thread's connections to flush, by ring
+    static _Thread_local conn_list_t *by_ring = NULL;
+    if (by_ring == NULL)
+        by_ring = xcalloc(ring_cnt, sizeof(*by_ring));
+    for (size_t i = 0; i < dirty->len; ++i) {
+        conn_t *c = dirty->data[i];
+        conn_list_push(&by_ring[(ring_t *)c->owner - rings], c);
+    }
+    dirty->len = 0;
+    for (unsigned i = 0; i < ring_cnt; ++i)
+        ring_kick(&rings[i], &by_ring[i]);
+}
+
+const net_backend_ops_t net_uring_ops = {
+    .init = uring_init, .run = uring_run, .flush = uring_flush};
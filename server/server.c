@@ -1,242 +1,710 @@
-#define __IS_SERVER
-#include "lib/common.h"
-#include <netinet/in.h>
+#include "net.h"
+#include <limits.h>
 #include <stdbool.h>
 #include <time.h>
 const char *APPNAME = "game_server";
 #define DEFAULT_LISTEN_ADDRESS "0.0.0.0"
-#define MAX_USER_COUNT 1024
+// Keeps ids within the 16 bits that clients without MSG_FEAT_ID32 read; only
+// servers that refuse such clients may go beyond
+#define DEFAULT_MAX_USERS UINT16_MAX
 #define MAX_QUEUE_SIZE 65536
+// Messages handled between two net_flush()'es
+#define FLUSH_BATCH 64
+// How long the game thread waits for messages while readers hold old chat
+// views, before it tries to free them again
+#define CHAT_RECLAIM_NS 1000000
+#define DEFAULT_OUTBUF_LIMIT (256 * 1024)
+#define DEFAULT_RING_ENTRIES 4096
+// The kernel refuses bigger rings
+#define MAX_RING_ENTRIES 32768
+// The threads need little stack: nothing big lives on it
+#define DEFAULT_THREAD_STACK_KB 256
+// Messages a client may send a second in all, and chat and challenges asked
+#define DEFAULT_RATE_LIMIT 50
+#define DEFAULT_CHAT_RATE 5
+// Bursts may use up this many seconds' worth at once
+#define RATE_BURST_SECONDS 2
 #define MAXHP 10
+// Each thread that sends takes a bit in conn_t.dirty
+#define MAX_BATTLE_WORKERS 16
+// Battles on one strand run one at a time
+#define BATTLE_STRANDS 1024
+// Chat from one connection is broadcast in order by one strand
+#define CHAT_STRANDS 64
 
-static void *user_by_id, *user_by_fd, *user_by_nick, *ch_by_id;
+// Users by fd are attached to their connections, see net_user()
+static hashtab_t user_by_id, user_by_nick, ch_by_id;
+// Users who are sent the whole roster, as they do not subscribe to a window
+static hashtab_t pushed_by_id;
+static pool_t user_pool = POOL_INITIALIZER("user_info_t", user_info_t);
+static pool_t ch_pool = POOL_INITIALIZER("challenge_t", challenge_t);
 static size_t user_cnt = 0;
+static uint32_t max_users = DEFAULT_MAX_USERS;
+// Whether clients without MSG_FEAT_ID32 are refused
+static bool id32_only = false;
 
-typedef struct send_uinfo_wkst_t {
-    enum { MSG_TO_ALL, ALL_TO_ONE } type;
-    union {
-        int to_fd;
-        int except_fd;
-    };
-    message_t *msg;
-} send_uinfo_wkst_t;
-
-static void send_user_info(const void *pnode, VISIT visit, void *parg) {
-    if (visit != postorder && visit != leaf)
-        return;
+/* Hands out ids from 1 up. Released ids are reused oldest first, so that
+ * stale ids rarely reach a new owner and ids stay below the peak count. */
+typedef struct id_pool_t {
+    uint32_t last;
+    // Ring of released ids
+    uint32_t *free;
+    size_t head, cnt, cap;
+} id_pool_t;
 
-    send_uinfo_wkst_t *arg = parg;
-    const user_info_t *user = *(const user_info_t **)pnode;
-    switch (arg->type) {
-    case ALL_TO_ONE: {
-        assert(user->fd >= 0);
-        // Send all users' info to the user at arg->to_fd
-        if (arg->msg == NULL) {
-            arg->msg = make_uchange();
-        }
-        message_t *newmsg = NULL;
-        if (!uchange_add_or_create(arg->msg, &newmsg, user->nickname, user->id,
-                                   user->state, user->score)) {
-            // Must send the old info
-            log_info("Sending info of user %u to fd %d", user->id, arg->to_fd);
-            msg_send(arg->to_fd, arg->msg);
-            free(arg->msg);
-            arg->msg = newmsg;
-        }
-    } break;
-    case MSG_TO_ALL: {
-        // Send arg->msg to every user except arg->except_fd
-        if (user->fd != arg->except_fd) {
+static id_pool_t user_ids, ch_ids;
+
+static uint32_t id_get(id_pool_t *pool) {
+    if (pool->cnt == 0)
+        return ++pool->last;
+    uint32_t id = pool->free[pool->head];
+    pool->head = (pool->head + 1) % pool->cap;
+    --pool->cnt;
+    return id;
+}
+
+static void id_put(id_pool_t *pool, uint32_t id) {
+    if (pool->cnt == pool->cap) {
+        size_t cap = max_(pool->cap * 2, 64);
+        uint32_t *ring = xmalloc(cap * sizeof(*ring));
+        for (size_t i = 0; i < pool->cnt; ++i)
+            ring[i] = pool->free[(pool->head + i) % pool->cap];
+        free(pool->free);
+        pool->free = ring;
+        pool->head = 0;
+        pool->cap = cap;
+    }
+    pool->free[(pool->head + pool->cnt++) % pool->cap] = id;
+}
+
+/* Sends msg to every user except the one at except_fd. Roster updates only
+ * go to users without a subscription. */
+static void broadcast(const message_t *msg, int except_fd) {
+    shared_msg_t sm;
+    shared_msg_init(&sm, msg);
+    const hashtab_t *to = msg->head.kind == UCHANGE ? &pushed_by_id : &user_by_id;
+    for (size_t i = 0; i < to->cnt; ++i) {
+        const user_info_t *user = to->items[i];
+        if (user->fd != except_fd) {
             log_info("Broadcasting to fd %d (%s)", user->fd, user->nickname);
-            msg_send(user->fd, arg->msg);
+            net_send_shared(user->fd, &sm);
         }
-    } break;
     }
+    shared_msg_done(&sm);
 }
 
-static void broadcast_user_changes(user_info_t *usr1, user_info_t *usr2) {
-    message_t *uchange = make_uchange();
-    static_assert(UCHANGE_MAX_UCNT >= 2, "");
-    user_info_t *u[2] = {usr1, usr2};
-    for (int i = 0; i < ARRAY_SIZE(u); ++i) {
-        if (u[i]) {
-            uchange_add_or_create(uchange, NULL, u[i]->nickname, u[i]->id,
-                                  u[i]->state, u[i]->score);
+/* The roster as it is sent to joining users: UCHANGE pages of
+ * UCHANGE_MAX_UCNT users each, encoded once and shared by all joiners until a
+ * user on the page changes. */
+typedef struct roster_page_t {
+    message_t msg;
+    shared_msg_t sm;
+    bool stale;
+    // Set if who is on the page changed since chat_view was published
+    bool members_stale;
+} roster_page_t;
+
+static user_info_t **roster_users = NULL;
+static size_t roster_cnt = 0, roster_cap = 0;
+static roster_page_t **roster_pages = NULL;
+static size_t roster_page_cnt = 0;
+
+/* The roster sorted in each order, for subscribers and LEADERBOARD */
+typedef struct roster_rank_t {
+    ranklist_t list;
+    // Ranks in [lo, hi) changed since the last subs_refresh()
+    size_t lo, hi;
+} roster_rank_t;
+
+static roster_rank_t roster_ranks[RO_MAX];
+// Set if a subscriber may have to be sent something
+static bool subs_dirty = false;
+// Counts subs_refresh() calls, see user_info_t.changed_at
+static uint64_t subs_epoch = 1;
+
+static user_info_t *rank_user(const ranklist_node_t *node, roster_order_t o) {
+    return (user_info_t *)((char *)(node - o) -
+                           offsetof(user_info_t, rank_node));
+}
+
+static int rank_cmp(const ranklist_node_t *p, const ranklist_node_t *q,
+                    void *porder) {
+    roster_order_t order = (uintptr_t)porder;
+    const user_info_t *u = rank_user(p, order), *v = rank_user(q, order);
+    if (order == RO_SCORE && u->score != v->score)
+        return u->score > v->score ? -1 : 1;
+    int res = memcmp(u->nick_key, v->nick_key, NICKNAME_LEN);
+    return res ? res : (u->id > v->id) - (u->id < v->id);
+}
+
+static void rank_init() {
+    for (roster_order_t o = 0; o < RO_MAX; ++o)
+        ranklist_init(&roster_ranks[o].list, rank_cmp, (void *)(uintptr_t)o);
+}
+
+static size_t roster_rank(const user_info_t *user, roster_order_t o) {
+    return ranklist_rank(&user->rank_node[o]);
+}
+
+/* Marks ranks [lo, hi) of r as changed. */
+static void rank_touch(roster_rank_t *r, size_t lo, size_t hi) {
+    subs_dirty = true;
+    if (r->lo < r->hi) {
+        r->lo = min_(r->lo, lo);
+        r->hi = max_(r->hi, hi);
+    } else {
+        r->lo = lo;
+        r->hi = hi;
+    }
+}
+
+/* Restores the order after user changed; everyone else is still sorted. */
+static void rank_update(user_info_t *user) {
+    user->changed_at = subs_epoch;
+    for (roster_order_t o = 0; o < RO_MAX; ++o) {
+        roster_rank_t *r = &roster_ranks[o];
+        ranklist_node_t *node = &user->rank_node[o],
+                        *prev = ranklist_prev(node),
+                        *next = ranklist_next(node);
+        size_t from = ranklist_rank(node), to = from;
+        if ((prev && rank_cmp(prev, node, r->list.arg) > 0) ||
+            (next && rank_cmp(node, next, r->list.arg) > 0)) {
+            ranklist_remove(&r->list, node);
+            ranklist_insert(&r->list, node);
+            to = ranklist_rank(node);
         }
+        rank_touch(r, min_(from, to), max_(from, to) + 1);
     }
-    send_uinfo_wkst_t arg = {
-        .type = MSG_TO_ALL, .msg = uchange, .except_fd = -1};
-    twalk_r(user_by_id, send_user_info, &arg);
-    free(uchange);
 }
 
-typedef struct queue_entry_t {
-    enum { EMSG, EDISCONN } kind;
-    int fd;
-    union {
-        message_t *msg;
-    };
-} queue_entry_t;
-static queue_t *incoming_queue = NULL;
+static void roster_touch(size_t slot) {
+    roster_page_t *page = roster_pages[slot / UCHANGE_MAX_UCNT];
+    if (!page->stale) {
+        shared_msg_done(&page->sm);
+        page->stale = true;
+    }
+}
 
-typedef struct serve_arg_t {
-    int fd;
-    struct sockaddr_in sin;
-} serve_arg_t;
+/* Who chat goes to, as seen by the threads that broadcast it. The game
+ * thread publishes a new version at the end of each batch in which someone
+ * joined or left. Versions share the pages nobody joined or left, and old
+ * ones are freed once the readers that entered with epoch_enter() are gone.
+ * The pages follow the roster pages. */
+typedef struct chat_member_t {
+    uint32_t id, key;
+    // Held by the page
+    struct conn_t *conn;
+} chat_member_t;
 
-static void random_init() {
-    static bool ok = false;
-    if (!ok) {
-        time_t epoch = time(NULL);
-        srandom(epoch);
-        ok = true;
+typedef struct chat_page_t {
+    size_t cnt;
+    chat_member_t members[UCHANGE_MAX_UCNT];
+} chat_page_t;
+
+typedef struct chat_view_t {
+    size_t page_cnt;
+    chat_page_t *pages[];
+} chat_view_t;
+
+static _Atomic(chat_view_t *) chat_view = NULL;
+// Set if someone joined or left since chat_view was published
+static bool chat_view_dirty = false;
+
+/* Like roster_touch(), when another user takes slot or leaves it. */
+static void roster_moved(size_t slot) {
+    roster_touch(slot);
+    roster_pages[slot / UCHANGE_MAX_UCNT]->members_stale = true;
+    chat_view_dirty = true;
+}
+
+static void roster_add(user_info_t *user) {
+    if (roster_cnt == roster_cap) {
+        roster_cap = max_(roster_cap * 2, 64);
+        user_info_t **p = realloc(roster_users, roster_cap * sizeof(*p));
+        roster_page_t **q =
+            realloc(roster_pages, roster_cap / UCHANGE_MAX_UCNT * sizeof(*q));
+        if (p == NULL || q == NULL)
+            ppanic("Memory allocation failed");
+        roster_users = p;
+        roster_pages = q;
+    }
+    if (roster_cnt == roster_page_cnt * UCHANGE_MAX_UCNT) {
+        roster_page_t *page = xmalloc(sizeof(*page));
+        page->stale = page->members_stale = true;
+        roster_pages[roster_page_cnt++] = page;
+    }
+    user->roster_slot = roster_cnt++;
+    roster_users[user->roster_slot] = user;
+    roster_moved(user->roster_slot);
+    user->changed_at = subs_epoch;
+    for (roster_order_t o = 0; o < RO_MAX; ++o) {
+        roster_rank_t *r = &roster_ranks[o];
+        ranklist_insert(&r->list, &user->rank_node[o]);
+        // Everyone after the new user moves down
+        rank_touch(r, roster_rank(user, o), roster_cnt);
     }
 }
 
-static uint32_t random_key() {
-    uint32_t ret = random();
-    return random() % 2 ? ret : ~ret;
+/* The last user takes over the slot of user, keeping the pages dense. */
+static void roster_remove(user_info_t *user) {
+    for (roster_order_t o = 0; o < RO_MAX; ++o) {
+        roster_rank_t *r = &roster_ranks[o];
+        rank_touch(r, roster_rank(user, o), roster_cnt);
+        ranklist_remove(&r->list, &user->rank_node[o]);
+    }
+    size_t slot = user->roster_slot, last = --roster_cnt;
+    assert(roster_users[slot] == user);
+    roster_moved(slot);
+    roster_moved(last);
+    roster_users[slot] = roster_users[last];
+    roster_users[slot]->roster_slot = slot;
+    if (last % UCHANGE_MAX_UCNT == 0) {
+        // The last page is empty now; it is stale after roster_touch()
+        free(roster_pages[--roster_page_cnt]);
+    }
+}
+
+static void roster_send(int fd) {
+    for (size_t i = 0; i < roster_page_cnt; ++i) {
+        roster_page_t *page = roster_pages[i];
+        if (page->stale) {
+            init_msg_buf(&page->msg, UCHANGE);
+            size_t end = min_((i + 1) * UCHANGE_MAX_UCNT, roster_cnt);
+            for (size_t j = i * UCHANGE_MAX_UCNT; j < end; ++j) {
+                const user_info_t *u = roster_users[j];
+                uchange_add_or_create(&page->msg, NULL, u->nickname, u->id,
+                                      u->state, u->score);
+            }
+            shared_msg_init(&page->sm, &page->msg);
+            page->stale = false;
+        }
+        net_send_shared(fd, &page->sm);
+    }
+}
+
+static void chat_page_free(void *ppage) {
+    chat_page_t *page = ppage;
+    for (size_t i = 0; i < page->cnt; ++i)
+        conn_release(page->members[i].conn);
+    free(page);
+}
+
+/* Publishes who is in the roster if that changed, and frees the versions
+ * no reader holds any more. Returns true if some are still held. */
+static bool chat_view_publish() {
+    if (!chat_view_dirty)
+        return epoch_reclaim();
+    chat_view_t *old = atomic_load_explicit(&chat_view, memory_order_relaxed),
+                *view = xmalloc(sizeof(*view) +
+                                roster_page_cnt * sizeof(view->pages[0]));
+    view->page_cnt = roster_page_cnt;
+    for (size_t i = 0; i < roster_page_cnt; ++i) {
+        if (!roster_pages[i]->members_stale) {
+            view->pages[i] = old->pages[i];
+            continue;
+        }
+        chat_page_t *page = xmalloc(sizeof(*page));
+        size_t first = i * UCHANGE_MAX_UCNT;
+        page->cnt = min_(first + UCHANGE_MAX_UCNT, roster_cnt) - first;
+        for (size_t j = 0; j < page->cnt; ++j) {
+            const user_info_t *u = roster_users[first + j];
+            // Users are removed before their connections are closed
+            chat_member_t m = {.id = u->id, .key = u->key,
+                               .conn = net_conn(u->fd)};
+            assert(m.conn);
+            page->members[j] = m;
+        }
+        view->pages[i] = page;
+        roster_pages[i]->members_stale = false;
+    }
+    atomic_store_explicit(&chat_view, view, memory_order_release);
+    chat_view_dirty = false;
+    if (old) {
+        for (size_t i = 0; i < old->page_cnt; ++i) {
+            if (i >= view->page_cnt || view->pages[i] != old->pages[i])
+                epoch_retire(chat_page_free, old->pages[i]);
+        }
+        epoch_retire(free, old);
+    }
+    return epoch_reclaim();
+}
+
+/* Looks for the member id holding key in view. */
+static bool chat_view_has(const chat_view_t *view, uint32_t id,
+                          uint32_t key) {
+    for (size_t i = 0; i < view->page_cnt; ++i) {
+        const chat_page_t *page = view->pages[i];
+        for (size_t j = 0; j < page->cnt; ++j) {
+            if (page->members[j].id == id)
+                return page->members[j].key == key;
+        }
+    }
+    return false;
 }
 
-static void build_inet_addr(const char *address, uint32_t port,
-                            struct sockaddr_in *sin) {
-    struct in_addr saddr;
-    if (inet_aton(address, &saddr) == 0) {
-        ppanic("Invalid server IP address: %s", address);
+/* What a subscriber has been sent about a user */
+typedef struct sub_entry_t {
+    uint32_t id;
+    uint16_t state;
+    int32_t score;
+} sub_entry_t;
+
+typedef struct subscription_t {
+    roster_order_t order;
+    uint32_t offset;
+    uint16_t limit;
+    // Position in subscribers
+    size_t idx;
+    // What the client knows, sorted by id; room for the window, the
+    // subscriber, its opponent and a challenger (see sub_show())
+    sub_entry_t *shown;
+    size_t shown_cnt;
+    // User count the client knows
+    uint32_t total;
+    // Whether the client must be sent a SUBSCRIBE_R and a new window
+    bool reset;
+} subscription_t;
+
+#define sub_shown_cap(sub) ((size_t)(sub)->limit + 3)
+
+static user_info_t **subscribers = NULL;
+static size_t sub_cnt = 0, sub_cap = 0;
+
+static void sub_create(user_info_t *user) {
+    subscription_t *sub = xcalloc(1, sizeof(*sub));
+    sub->order = RO_SCORE;
+    sub->shown = xmalloc(sub_shown_cap(sub) * sizeof(*sub->shown));
+    if (sub_cnt == sub_cap) {
+        sub_cap = max_(sub_cap * 2, 64);
+        subscribers = realloc(subscribers, sub_cap * sizeof(*subscribers));
+        if (subscribers == NULL)
+            ppanic("Memory allocation failed");
     }
+    sub->idx = sub_cnt++;
+    subscribers[sub->idx] = user;
+    user->sub = sub;
+    subs_dirty = true;
+}
+
+static void sub_destroy(user_info_t *user) {
+    subscription_t *sub = user->sub;
+    subscribers[sub->idx] = subscribers[--sub_cnt];
+    subscribers[sub->idx]->sub->idx = sub->idx;
+    free(sub->shown);
+    free(sub);
+    user->sub = NULL;
+}
+
+static int cmp_by_id_ptr(const void *u, const void *v) {
+    return cmp_by_id(*(user_info_t *const *)u, *(user_info_t *const *)v);
+}
 
-    sin->sin_addr = saddr;
-    sin->sin_port = htons(port);
-    sin->sin_family = AF_INET;
+/* The other party of the challenge user is in, if any */
+static user_info_t *user_opponent(const user_info_t *user) {
+    challenge_t tmp = {.id = user->chid};
+    const challenge_t *ch =
+        user->chid ? hashtab_find(&ch_by_id, &tmp) : NULL;
+    // The challenge may be gone and its id reused
+    if (ch == NULL || (ch->user1 != user->id && ch->user2 != user->id))
+        return NULL;
+    user_info_t utmp = {.id = ch->user1 == user->id ? ch->user2 : ch->user1};
+    return hashtab_find(&user_by_id, &utmp);
 }
 
-static int do_listen(const char *address, uint32_t port) {
-    struct sockaddr_in sin;
-    build_inet_addr(address, port, &sin);
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd == -1) {
-        ppanic("socket()");
+/* Adds a user to the UCHANGE being built in msg for fd, sending msg first if
+ * it is full. Returns false if a message was dropped. */
+static bool sub_push(int fd, message_t *msg, const char *nickname, uint32_t id,
+                     user_state_t state, int32_t score) {
+    bool ok = true;
+    if (msg->body.uchange.count == UCHANGE_MAX_UCNT) {
+        ok = net_send(fd, msg) == 0;
+        init_msg_buf(msg, UCHANGE);
     }
+    uchange_add_or_create(msg, NULL, nickname, id, state, score);
+    return ok;
+}
 
-    if (bind(fd, (const struct sockaddr *)&sin, sizeof(sin)) != 0) {
-        ppanic("bind()");
+/* Sends the subscriber of user whatever changed in its window. */
+static void sub_refresh(user_info_t *user) {
+    subscription_t *sub = user->sub;
+    const roster_rank_t *r = &roster_ranks[sub->order];
+    user_info_t *want[SUBSCRIBE_MAX_LIMIT + 2];
+    size_t n = 0;
+    for (const ranklist_node_t *node = ranklist_at(&r->list, sub->offset);
+         node && n < sub->limit; node = ranklist_next(node)) {
+        want[n++] = rank_user(node, sub->order);
     }
-    if (listen(fd, 4096) != 0) {
-        ppanic("listen()");
+    want[n++] = user;
+    user_info_t *opponent = user_opponent(user);
+    if (opponent)
+        want[n++] = opponent;
+    qsort(want, n, sizeof(*want), cmp_by_id_ptr);
+
+    bool ok = true;
+    if (sub->reset) {
+        message_t msg;
+        init_msg_buf(&msg, SUBSCRIBE_R);
+        msg.body.subscribe_r = (msg_subscribe_r_t){.error = ME_OK,
+                                                   .order = sub->order,
+                                                   .offset = sub->offset,
+                                                   .limit = sub->limit,
+                                                   .total = roster_cnt};
+        ok = net_send(user->fd, &msg) == 0;
+        sub->shown_cnt = 0;
+        sub->total = roster_cnt;
+        sub->reset = false;
+    } else if (sub->total != roster_cnt) {
+        message_t msg;
+        init_msg_buf(&msg, UCOUNT);
+        msg.body.ucount.total = roster_cnt;
+        ok = net_send(user->fd, &msg) == 0;
+        sub->total = roster_cnt;
     }
 
-    return fd;
+    // Both lists are sorted by id
+    message_t msg;
+    init_msg_buf(&msg, UCHANGE);
+    const sub_entry_t *shown = sub->shown;
+    size_t i = 0, j = 0, m = 0;
+    sub_entry_t next[SUBSCRIBE_MAX_LIMIT + 2];
+    while (i < sub->shown_cnt || j < n) {
+        if (j == n || (i < sub->shown_cnt && shown[i].id < want[j]->id)) {
+            ok &= sub_push(user->fd, &msg, "", shown[i].id, UHIDDEN,
+                           shown[i].score);
+            ++i;
+            continue;
+        }
+        const user_info_t *u = want[j++];
+        if (j > 1 && want[j - 2] == u)
+            continue;
+        bool known = i < sub->shown_cnt && shown[i].id == u->id;
+        if (!known || shown[i].state != u->state ||
+            shown[i].score != u->score) {
+            ok &= sub_push(user->fd, &msg, u->nickname, u->id, u->state,
+                           u->score);
+        }
+        if (known)
+            ++i;
+        next[m++] = (sub_entry_t){
+            .id = u->id, .state = u->state, .score = u->score};
+    }
+    if (msg.body.uchange.count)
+        ok &= net_send(user->fd, &msg) == 0;
+    memcpy(sub->shown, next, m * sizeof(*next));
+    sub->shown_cnt = m;
+    if (!ok) {
+        // The client missed something; start over at the next refresh
+        sub->reset = true;
+        subs_dirty = true;
+    }
 }
 
-static void *serve(void *parg) {
-    serve_arg_t arg = *(serve_arg_t *)parg;
-    free(parg);
-    parg = NULL;
+/* Lets the subscriber of user know about other, which may be out of its
+ * window, until the next refresh. */
+static void sub_show(user_info_t *user, const user_info_t *other) {
+    subscription_t *sub = user->sub;
+    size_t i = 0;
+    while (i < sub->shown_cnt && sub->shown[i].id < other->id)
+        ++i;
+    if (i < sub->shown_cnt && sub->shown[i].id == other->id)
+        return;
+    if (sub->shown_cnt == sub_shown_cap(sub))
+        return;
+    message_t *msg = make_uchange();
+    uchange_add_or_create(msg, NULL, other->nickname, other->id, other->state,
+                          other->score);
+    if (net_send(user->fd, msg) == 0) {
+        memmove(&sub->shown[i + 1], &sub->shown[i],
+                (sub->shown_cnt - i) * sizeof(*sub->shown));
+        sub->shown[i] = (sub_entry_t){
+            .id = other->id, .state = other->state, .score = other->score};
+        ++sub->shown_cnt;
+    }
+    msg_free(msg);
+}
 
-    int fd = arg.fd;
-    char addr_buf[64];
-    {
-        char *addr = inet_ntoa(arg.sin.sin_addr);
-        snprintf(addr_buf, sizeof(addr_buf), "%s:%u", addr,
-                 ntohs(arg.sin.sin_port));
+static bool rank_changed(const roster_rank_t *r, size_t lo, size_t hi) {
+    return lo < hi && r->lo < r->hi && lo < r->hi && r->lo < hi;
+}
+
+/* Refreshes the subscribers whose window, own entry or opponent changed. */
+static void subs_refresh() {
+    if (!subs_dirty)
+        return;
+    subs_dirty = false;
+    for (size_t i = 0; i < sub_cnt; ++i) {
+        user_info_t *user = subscribers[i];
+        const subscription_t *sub = user->sub;
+        const roster_rank_t *r = &roster_ranks[sub->order];
+        const user_info_t *opponent = user_opponent(user);
+        if (sub->reset || sub->total != roster_cnt ||
+            rank_changed(r, sub->offset, (size_t)sub->offset + sub->limit) ||
+            user->changed_at == subs_epoch ||
+            (opponent && opponent->changed_at == subs_epoch)) {
+            sub_refresh(user);
+        }
     }
-    log_info("Accepted connection from %s", addr_buf);
+    for (roster_order_t o = 0; o < RO_MAX; ++o)
+        roster_ranks[o].lo = roster_ranks[o].hi = 0;
+    ++subs_epoch;
+}
 
-    while (1) {
-        message_t buf;
-        if (msg_recv(fd, &buf, true) == 0) {
-            log_info("Received packet; enqueueing it...");
-            queue_entry_t *pq = xmalloc(sizeof(*pq));
-            pq->kind = EMSG;
-            pq->fd = fd;
-            pq->msg = xmalloc(sizeof(*pq->msg));
-            memcpy(pq->msg, &buf, sizeof(*pq->msg));
-            queue_add(incoming_queue, pq, true);
-        } else {
-            if (errno != EWOULDBLOCK && errno != EAGAIN) {
-                log_error(
-                    "Received corrupted packet from %s (%s); must shutdown...",
-                    addr_buf, strerror(errno));
-                break;
+// Roster changes are coalesced and broadcast every uchange_tick ms if set
+static uint32_t uchange_tick = 0;
+// What UCHANGE tells of the users changed since the last tick, by id
+static hashtab_t uchange_pending;
+static pool_t uchange_pool =
+    POOL_INITIALIZER("msg_uchange_user_t", msg_uchange_user_t);
+static atomic_bool tick_posted;
+
+static uint64_t hash_by_uchange_id(const void *e) {
+    return hash_u64(((const msg_uchange_user_t *)e)->id);
+}
+static bool eq_by_uchange_id(const void *e, const void *f) {
+    return ((const msg_uchange_user_t *)e)->id ==
+           ((const msg_uchange_user_t *)f)->id;
+}
+
+static void uchange_queue(const user_info_t *user) {
+    msg_uchange_user_t key = {.id = user->id};
+    msg_uchange_user_t *e = hashtab_find(&uchange_pending, &key);
+    if (e == NULL) {
+        e = pool_alloc(&uchange_pool);
+        e->id = user->id;
+        memcpy(e->nickname, user->nickname, NICKNAME_LEN);
+        hashtab_insert(&uchange_pending, e);
+    }
+    // The latest state wins
+    e->state = user->state;
+    e->score = user->score;
+}
+
+/* Broadcasts the changes queued since the last tick as packed pages. */
+static void uchange_flush() {
+    atomic_store(&tick_posted, false);
+    subs_refresh();
+    if (uchange_pending.cnt == 0)
+        return;
+    message_t *msg = make_uchange();
+    for (size_t i = 0; i < uchange_pending.cnt; ++i) {
+        msg_uchange_user_t *e = uchange_pending.items[i];
+        message_t *newmsg = NULL;
+        if (!uchange_add_or_create(msg, &newmsg, e->nickname, e->id, e->state,
+                                   e->score)) {
+            // Must send the full page
+            broadcast(msg, -1);
+            msg_free(msg);
+            msg = newmsg;
+        }
+        pool_free(&uchange_pool, e);
+    }
+    broadcast(msg, -1);
+    msg_free(msg);
+    hashtab_destroy(&uchange_pending);
+}
+
+static void broadcast_user_changes(user_info_t *usr1, user_info_t *usr2) {
+    message_t *uchange = make_uchange();
+    static_assert(UCHANGE_MAX_UCNT >= 2, "");
+    user_info_t *u[2] = {usr1, usr2};
+    for (int i = 0; i < ARRAY_SIZE(u); ++i) {
+        if (u[i]) {
+            roster_touch(u[i]->roster_slot);
+            rank_update(u[i]);
+            if (uchange_tick) {
+                uchange_queue(u[i]);
+            } else {
+                uchange_add_or_create(uchange, NULL, u[i]->nickname,
+                                      u[i]->id, u[i]->state, u[i]->score);
             }
         }
     }
-    log_info("Disconnected from %s", addr_buf);
-    queue_entry_t *pq = xmalloc(sizeof(*pq));
-    pq->kind = EDISCONN;
-    pq->fd = fd;
-    queue_add(incoming_queue, pq, true);
-    return 0;
+    if (!uchange_tick)
+        broadcast(uchange, -1);
+    msg_free(uchange);
+}
+
+static mpsc_queue_t *incoming_queue = NULL;
+
+static void random_init() {
+    static bool ok = false;
+    if (!ok) {
+        time_t epoch = time(NULL);
+        srandom(epoch);
+        ok = true;
+    }
+}
+
+static uint32_t random_key() {
+    uint32_t ret = random();
+    return random() % 2 ? ret : ~ret;
 }
 
 static void model_init() {
     user_cnt = 0;
-    user_by_id = user_by_fd = user_by_nick = ch_by_id = NULL;
+    hashtab_init(&user_by_id, hash_by_id, eq_by_id);
+    hashtab_init(&user_by_nick, hash_by_nick, eq_by_nick);
+    hashtab_init(&ch_by_id, hash_by_chid, eq_by_chid);
+    hashtab_init(&pushed_by_id, hash_by_id, eq_by_id);
+    hashtab_init(&uchange_pending, hash_by_uchange_id, eq_by_uchange_id);
+    rank_init();
 }
 
 // Copies nickname
 static user_info_t *user_create(const char *nickname) {
-    user_info_t *user = xmalloc(sizeof(*user));
+    user_info_t *user = pool_alloc(&user_pool);
     user->chid = user->id = 0;
     user->key = random_key();
     user->state = UONLINE;
     user->score = 0;
+    user->sub = NULL;
     // user->nickname = xmalloc(NICKNAME_LEN);
     snprintf(user->nickname, NICKNAME_LEN, "%s", nickname);
+    nick_fold(user->nick_key, user->nickname);
+    user->nick_hash = hash_nick_key(user->nick_key);
     return user;
 }
 
 static void user_destroy(user_info_t *user) {
     // free(user->nickname);
-    free(user);
+    pool_free(&user_pool, user);
 }
 
 static user_info_t *user_add(int fd, const char *nickname, msg_err_t *err) {
     user_info_t *user = user_create(nickname);
+    user->fd = fd;
 
-    if (user_cnt >= MAX_USER_COUNT) {
+    if (user_cnt >= max_users) {
         *err = TOOMANYUSER;
         goto free;
     }
 
-    if (tfind(user, &user_by_fd, cmp_by_fd)) {
+    if (net_user(fd)) {
         *err = JOINTWICE;
         goto free;
     }
 
-    if (tfind(user, &user_by_nick, cmp_by_nick)) {
+    if (hashtab_find(&user_by_nick, user)) {
         *err = DUPNICK;
         goto free;
     }
 
-    uint16_t id = fd % UINT16_MAX;
-    for (int _ = 0; _ < 16; ++_) {
-        if (tfind(user, &user_by_id, cmp_by_id)) {
-            id = (id + random()) % UINT16_MAX;
-            continue;
-        }
+    user->id = id_get(&user_ids);
+    user_info_t *ptr;
+    // map id to user
+    ptr = hashtab_insert(&user_by_id, user);
+    assert(ptr == user);
+    // map fd to user
+    net_set_user(fd, user);
+    // map nickname to user
+    ptr = hashtab_insert(&user_by_nick, user);
+    assert(ptr == user);
+    (void)ptr;
+    roster_add(user);
 
-        user->id = id;
-        user->fd = fd;
-        user_info_t **ptr;
-        // map id to user
-        ptr = tsearch(user, &user_by_id, cmp_by_id);
-        assert(*ptr == user);
-        // map fd to user
-        ptr = tsearch(user, &user_by_fd, cmp_by_fd);
-        assert(*ptr == user);
-        // map nickname to user
-        ptr = tsearch(user, &user_by_nick, cmp_by_nick);
-        assert(*ptr == user);
-
-        ++user_cnt;
-        *err = ME_OK;
-        return user;
-    }
-
-    log_error("Could not allocate ID");
-    *err = ME_OTHER;
-    return NULL;
+    ++user_cnt;
+    *err = ME_OK;
+    return user;
 
 free:
     user_destroy(user);
@@ -244,37 +712,35 @@ free:
 }
 
 static challenge_t *add_challenge() {
-    challenge_t *ch = xcalloc(1, sizeof(*ch));
+    challenge_t *ch = pool_calloc(&ch_pool);
     ch->state = ASKING;
+    ch->id = id_get(&ch_ids);
+    challenge_t *node = hashtab_insert(&ch_by_id, ch);
+    assert(node == ch);
+    (void)node;
+    return ch;
+}
 
-    for (int _ = 0; _ < 16; ++_) {
-        ch->id = random() % UINT16_MAX;
-        if (ch->id == 0)
-            ch->id = 1;
-        if (tfind(ch, &ch_by_id, cmp_by_chid)) {
-            continue;
-        }
-        challenge_t **node = tsearch(ch, &ch_by_id, cmp_by_chid);
-        assert(*node == ch);
-        return ch;
-    }
-
-    log_error("Could not allocate ID");
-    assert(0);
-    return NULL;
+static void challenge_del(challenge_t *ch) {
+    hashtab_remove(&ch_by_id, ch);
+    id_put(&ch_ids, ch->id);
+    pool_free(&ch_pool, ch);
 }
 
 static void user_del_and_destroy(user_info_t *user) {
-    user_info_t **node = tfind(user, &user_by_id, cmp_by_id);
-    if (node) {
-        user_info_t *user = *node;
-        assert(user);
-        if (tdelete(user, &user_by_id, cmp_by_id) == 0)
-            assert(0);
-        if (tdelete(user, &user_by_nick, cmp_by_nick) == 0)
+    user = hashtab_remove(&user_by_id, user);
+    if (user) {
+        if (hashtab_remove(&user_by_nick, user) == NULL)
             assert(0);
-        if (tdelete(user, &user_by_fd, cmp_by_fd) == 0)
+        if (net_user(user->fd) != user)
             log_error("Cannot unmap fd %d", user->fd);
+        net_set_user(user->fd, NULL);
+        if (user->sub)
+            sub_destroy(user);
+        else
+            hashtab_remove(&pushed_by_id, user);
+        roster_remove(user);
+        id_put(&user_ids, user->id);
         user_destroy(user);
         --user_cnt;
     }
@@ -282,51 +748,148 @@ static void user_del_and_destroy(user_info_t *user) {
 
 static void handle_join(int fd, msg_join_t *join) {
     msg_err_t err;
-    user_info_t *user = user_add(fd, join->nickname, &err);
+    user_info_t *user = NULL;
+    uint32_t features = join->features & MSG_FEATURES;
+    if (id32_only && !(features & MSG_FEAT_ID32)) {
+        // The client could not tell users apart
+        err = UNSUPPORTED;
+    } else {
+        user = user_add(fd, join->nickname, &err);
+    }
 
     {
         message_t *msg;
         if (err == ME_OK) {
             assert(user);
+            // Only a connection that just got its user switches formats, and
+            // before its JOIN_R is encoded
+            net_set_features(fd, features);
             msg = make_join_r(join->nickname, ME_OK, user->id, user->key);
         } else {
             msg = make_join_r(join->nickname, err, 0, 0);
         }
+        msg->body.join_r.features = features;
 
-        log_info("JOIN from %d: nickname = %s, err = %d, id = %d", fd,
+        log_info("JOIN from %d: nickname = %s, err = %d, id = %u", fd,
                  join->nickname, msg->body.join_r.error, msg->body.join_r.id);
-        msg_send(fd, msg);
-        free(msg);
+        net_send(fd, msg);
+        msg_free(msg);
     }
 
     if (err == ME_OK) {
-        // Send current all users' information to this new user
-        {
-            send_uinfo_wkst_t st = {
-                .type = ALL_TO_ONE, .to_fd = fd, .msg = NULL};
-            twalk_r(user_by_id, send_user_info, &st);
-            if (st.msg) {
-                log_info("Sending info of user %u (at %d) to fd %d", user->id,
-                         user->fd, fd);
-                msg_send(fd, st.msg);
-                free(st.msg);
-            }
+        if (features & MSG_FEAT_SUBSCRIBE) {
+            // Only sees itself until it subscribes to a window
+            sub_create(user);
+        } else {
+            hashtab_insert(&pushed_by_id, user);
+            // Send current all users' information to this new user
+            roster_send(fd);
         }
         // Send this new user's information to all users
-        {
-            send_uinfo_wkst_t st = {
-                .type = MSG_TO_ALL, .except_fd = fd, .msg = make_uchange()};
-            uchange_add_or_create(st.msg, NULL, user->nickname, user->id,
+        if (uchange_tick) {
+            uchange_queue(user);
+        } else {
+            message_t *uchange = make_uchange();
+            uchange_add_or_create(uchange, NULL, user->nickname, user->id,
                                   user->state, user->score);
-            twalk_r(user_by_id, send_user_info, &st);
-            free(st.msg);
+            broadcast(uchange, fd);
+            msg_free(uchange);
         }
     }
 }
 
-static void judge_turn(challenge_t *ch, int32_t force_lose_id) {
+static void handle_subscribe(int fd, msg_subscribe_t *subscribe) {
+    user_info_t tmp = {.id = subscribe->id};
+    user_info_t *user = hashtab_find(&user_by_id, &tmp);
+    message_t msg;
+    init_msg_buf(&msg, SUBSCRIBE_R);
+    msg.body.subscribe_r.error = ME_OTHER;
+    if (user == NULL) {
+        msg.body.subscribe_r.error = NXID;
+    } else if (user->key != subscribe->key) {
+        msg.body.subscribe_r.error = ICKEY;
+    } else if (user->sub == NULL || subscribe->order >= RO_MAX ||
+               subscribe->limit > SUBSCRIBE_MAX_LIMIT) {
+        msg.body.subscribe_r.error = INVARG;
+    } else {
+        subscription_t *sub = user->sub;
+        sub->order = subscribe->order;
+        sub->offset = subscribe->offset;
+        if (sub->limit != subscribe->limit) {
+            sub->limit = subscribe->limit;
+            free(sub->shown);
+            sub->shown = xmalloc(sub_shown_cap(sub) * sizeof(*sub->shown));
+        }
+        sub->shown_cnt = 0;
+        sub->reset = true;
+        log_info("SUBSCRIBE from %d: order = %u, offset = %u, limit = %u", fd,
+                 sub->order, sub->offset, sub->limit);
+        sub_refresh(user);
+        return;
+    }
+    net_send(fd, &msg);
+}
+
+static void handle_leaderboard(int fd, msg_leaderboard_t *lb) {
+    user_info_t tmp = {.id = lb->id};
+    user_info_t *user = hashtab_find(&user_by_id, &tmp);
+    message_t *msg = make_msg_buf(LEADERBOARD_R);
+    msg_leaderboard_r_t *r = &msg->body.leaderboard_r;
+    if (user == NULL) {
+        r->error = NXID;
+    } else if (user->key != lb->key) {
+        r->error = ICKEY;
+    } else if (lb->limit > LEADERBOARD_MAX_CNT) {
+        r->error = INVARG;
+    } else {
+        const ranklist_t *list = &roster_ranks[RO_SCORE].list;
+        r->error = ME_OK;
+        r->rank = roster_rank(user, RO_SCORE) + 1;
+        r->total = ranklist_size(list);
+        r->offset = lb->offset;
+        for (const ranklist_node_t *node = ranklist_at(list, lb->offset);
+             node && r->count < lb->limit; node = ranklist_next(node)) {
+            const user_info_t *u = rank_user(node, RO_SCORE);
+            msg_uchange_user_t *e = &r->users[r->count++];
+            snprintf(e->nickname, sizeof(e->nickname), "%s", u->nickname);
+            e->id = u->id;
+            e->state = u->state;
+            e->score = u->score;
+        }
+        log_info("LEADERBOARD from %d: offset = %u, count = %u, rank = %u", fd,
+                 r->offset, r->count, r->rank);
+    }
+    net_send(fd, msg);
+    msg_free(msg);
+}
+
+/* Battles run as tasks on the battle scheduler. A challenge belongs to the
+ * strand its id hashes to from the start of its battle: the game thread
+ * hands it over with EBATTLE, the reactors post TURN's straight to the
+ * strand, and the strand hands the challenge back with EBATTLE_END when the
+ * battle is over. Meanwhile the game thread only reads the ids of the
+ * challenge. */
+typedef struct battle_strand_t {
+    strand_t strand;
+    // Challenges in battle, by id
+    hashtab_t battles;
+    unsigned seed;
+} battle_strand_t;
+
+static sched_t *battle_sched = NULL;
+static battle_strand_t *battle_strands = NULL;
+static uint32_t battle_worker_cnt = 1;
+static strand_t chat_strands[CHAT_STRANDS];
+
+static battle_strand_t *battle_strand_of(uint32_t chid) {
+    return &battle_strands[hash_u64(chid) % BATTLE_STRANDS];
+}
+
+/* force_lose_id is the id of a user who gives up, or 0 */
+static void judge_turn(battle_strand_t *bs, challenge_t *ch,
+                       uint32_t force_lose_id) {
     bool fin = false;
-    uint16_t winner;
+    uint32_t winner;
     if (ch->turn_no == 0) {
         ch->acted1 = ch->acted2 = false;
         ch->turn_no = 1;
@@ -334,7 +897,7 @@ static void judge_turn(challenge_t *ch, int32_t force_lose_id) {
         ++ch->turn_no;
     }
     if (ch->acted1 && ch->acted2) {
-        int32_t damage = random() % 5 + 1;
+        int32_t damage = rand_r(&bs->seed) % 5 + 1;
         int32_t d1 = 0, d2 = 0;
         switch (get_turn_result(ch->act1, ch->act2)) {
         case TR_WIN:
@@ -351,10 +914,10 @@ static void judge_turn(challenge_t *ch, int32_t force_lose_id) {
         ch->hp2 -= d2;
     }
     ch->acted1 = ch->acted2 = false;
-    if (force_lose_id == ch->user1) {
+    if (force_lose_id && force_lose_id == ch->user1) {
         fin = true;
         winner = ch->user2;
-    } else if (force_lose_id == ch->user2) {
+    } else if (force_lose_id && force_lose_id == ch->user2) {
         fin = true;
         winner = ch->user1;
     } else {
@@ -381,47 +944,175 @@ static void judge_turn(challenge_t *ch, int32_t force_lose_id) {
         turn_r.winner = winner;
     }
     msg.body.turn_r = turn_r;
-    user_info_t *user1, *user2;
-    {
-        user_info_t tmp = {.id = ch->user1};
-        user1 = deref_or_null(tfind(&tmp, &user_by_id, cmp_by_id));
-        tmp.id = ch->user2;
-        user2 = deref_or_null(tfind(&tmp, &user_by_id, cmp_by_id));
+    net_send_conn(ch->conn1, &msg);
+    net_send_conn(ch->conn2, &msg);
+
+    if (fin) {
+        // The game thread changes scores and user states
+        int32_t bonus = rand_r(&bs->seed) % 4 + 1,
+                penalty = rand_r(&bs->seed) % 4;
+        ch->delta1 = ch->user1 == winner ? bonus : -penalty;
+        ch->delta2 = ch->user2 == winner ? bonus : -penalty;
+        hashtab_remove(&bs->battles, ch);
+        conn_release(ch->conn1);
+        conn_release(ch->conn2);
+        queue_entry_t *entry = queue_entry_new(EBATTLE_END, -1, NULL);
+        entry->ch = ch;
+        mpsc_add(incoming_queue, entry, true);
+    }
+}
+
+static void handle_turn(battle_strand_t *bs, msg_turn_t *turn) {
+    challenge_t tmp = {.id = turn->chid};
+    challenge_t *ch = hashtab_find(&bs->battles, &tmp);
+    if (ch == NULL)
+        return;
+    if (turn->user == ch->user1 && turn->key == ch->key1 &&
+        ch->acted1 == false) {
+        ch->act1 = turn->action;
+        ch->acted1 = true;
+    } else if (turn->user == ch->user2 && turn->key == ch->key2 &&
+               ch->acted2 == false) {
+        ch->act2 = turn->action;
+        ch->acted2 = true;
     }
 
-    msg_send(user1->fd, &msg);
-    msg_send(user2->fd, &msg);
+    if (ch->acted1 && ch->acted2)
+        judge_turn(bs, ch, 0);
+}
 
-    if (fin) {
-        // change scores and user states
-        int bonus = random() % 4 + 1, penalty = random() % 4;
-        if (user1->id == winner) {
-            user1->score += bonus;
-            user2->score -= penalty;
-        } else {
-            user2->score += bonus;
-            user1->score -= penalty;
+static void battle_entry(battle_strand_t *bs, queue_entry_t *entry) {
+    switch (entry->kind) {
+    case EMSG:
+        if (entry->msg->head.kind == TURN)
+            handle_turn(bs, &entry->msg->body.turn);
+        msg_free(entry->msg);
+        break;
+    case EBATTLE: {
+        challenge_t *ch = entry->ch;
+        challenge_t *node = hashtab_insert(&bs->battles, ch);
+        assert(node == ch);
+        (void)node;
+        ch->turn_no = 0;
+        judge_turn(bs, ch, 0);
+    } break;
+    case EFORFEIT: {
+        // The battle may be over already
+        challenge_t tmp = {.id = entry->forfeit.chid};
+        challenge_t *ch = hashtab_find(&bs->battles, &tmp);
+        if (ch)
+            judge_turn(bs, ch, entry->forfeit.user);
+    } break;
+    default:
+        assert(0);
+        break;
+    }
+    queue_entry_free(entry);
+}
+
+static uint32_t battle_entry_chid(const queue_entry_t *entry) {
+    switch (entry->kind) {
+    case EMSG:
+        return entry->msg->body.turn.chid;
+    case EBATTLE:
+        return entry->ch->id;
+    case EFORFEIT:
+        return entry->forfeit.chid;
+    default:
+        assert(0);
+        return 0;
+    }
+}
+
+static void battle_task(void *entry) {
+    battle_entry(battle_strand_of(battle_entry_chid(entry)), entry);
+}
+
+/* Runs entry on the strand of its battle. */
+static void battle_post(queue_entry_t *entry) {
+    strand_post(&battle_strand_of(battle_entry_chid(entry))->strand,
+                battle_task, entry);
+}
+
+/* Hands ch over to the strand of its battle. */
+static void battle_start(challenge_t *ch, const user_info_t *usr1,
+                         const user_info_t *usr2) {
+    // Users are removed before their connections are closed
+    ch->conn1 = net_conn(usr1->fd);
+    ch->conn2 = net_conn(usr2->fd);
+    assert(ch->conn1 && ch->conn2);
+    ch->key1 = usr1->key;
+    ch->key2 = usr2->key;
+    queue_entry_t *entry = queue_entry_new(EBATTLE, -1, NULL);
+    entry->ch = ch;
+    battle_post(entry);
+}
+
+/* Applies the outcome of a battle handed back by its strand. */
+static void battle_end(challenge_t *ch) {
+    const uint32_t ids[2] = {ch->user1, ch->user2};
+    const int32_t deltas[2] = {ch->delta1, ch->delta2};
+    user_info_t *u[2];
+    for (int i = 0; i < 2; ++i) {
+        user_info_t tmp = {.id = ids[i]};
+        u[i] = hashtab_find(&user_by_id, &tmp);
+        // A user who quit during the battle is gone, and its id may have
+        // been handed out again
+        if (u[i] && (u[i]->chid != ch->id || u[i]->state != UBATTLING))
+            u[i] = NULL;
+        if (u[i]) {
+            u[i]->score += deltas[i];
+            u[i]->state = UONLINE;
         }
-        if (user1->state == UBATTLING)
-            user1->state = UONLINE;
-        if (user2->state == UBATTLING)
-            user2->state = UONLINE;
-        broadcast_user_changes(user1, user2);
-        // delete challenge
-        tdelete(ch, &ch_by_id, cmp_by_chid);
     }
+    if (u[0] || u[1])
+        broadcast_user_changes(u[0], u[1]);
+    challenge_del(ch);
+}
+
+/* Withdraws the challenge user is asking for, if any, and tells whoever it
+ * was asked of. */
+static void challenge_cancel(user_info_t *user) {
+    challenge_t *ch;
+    {
+        challenge_t tmp = {.id = user->chid};
+        ch = hashtab_find(&ch_by_id, &tmp);
+    }
+    if (ch == NULL || ch->state != ASKING || ch->user1 != user->id)
+        return;
+    user->chid = 0;
+    user_info_t *user2;
+    {
+        user_info_t tmp = {.id = ch->user2};
+        user2 = hashtab_find(&user_by_id, &tmp);
+    }
+    if (user2) {
+        message_t msg;
+        init_challenge_r(&msg);
+        msg.body.challenge_r.error = CANCELLED;
+        msg.body.challenge_r.chid = ch->id;
+        msg.body.challenge_r.id1 = ch->user1;
+        msg.body.challenge_r.id2 = ch->user2;
+        net_send(user2->fd, &msg);
+    }
+    challenge_del(ch);
 }
 
 static void quit_user(struct user_info_t *user) {
-    assert(user_by_id);
+    if (user->state == UONLINE)
+        challenge_cancel(user);
     if (user->state == UBATTLING) {
         challenge_t *ch;
         {
             challenge_t tmp = {.id = user->chid};
-            ch = deref_or_null(tfind(&tmp, &ch_by_id, cmp_by_chid));
+            ch = hashtab_find(&ch_by_id, &tmp);
         }
         if (ch) {
-            judge_turn(ch, user->id);
+            // The worker ends the battle and hands it back
+            queue_entry_t *entry = queue_entry_new(EFORFEIT, -1, NULL);
+            entry->forfeit.chid = ch->id;
+            entry->forfeit.user = user->id;
+            battle_post(entry);
         }
     }
     user->state = UOFFLINE;
@@ -430,8 +1121,7 @@ static void quit_user(struct user_info_t *user) {
 }
 
 static void handle_disconnect(int fd) {
-    user_info_t tmp = {.fd = fd};
-    user_info_t *user = deref_or_null(tfind(&tmp, &user_by_fd, cmp_by_fd));
+    user_info_t *user = net_user(fd);
     if (user) {
         quit_user(user);
     }
@@ -439,14 +1129,14 @@ static void handle_disconnect(int fd) {
 
 static void handle_quit(msg_quit_t *quit) {
     user_info_t tmp = {.id = quit->id};
-    user_info_t **node = tfind(&tmp, &user_by_id, cmp_by_id);
-    if (node == NULL) {
+    user_info_t *user = hashtab_find(&user_by_id, &tmp);
+    if (user == NULL) {
         log_warning("Ignored QUIT for unknown user: %u", quit->id);
-    } else if ((*node)->key != quit->key) {
+    } else if (user->key != quit->key) {
         log_warning("Ignored QUIT for user %u (%s): Incorrect key", quit->id,
-                    (*node)->nickname);
+                    user->nickname);
     } else {
-        quit_user(*node);
+        quit_user(user);
     }
 }
 
@@ -463,14 +1153,14 @@ static void handle_challenge(int fd, msg_challenge_t *challenge) {
     {
         user_info_t tmp1 = {.id = challenge->id1},
                     tmp2 = {.id = challenge->id2};
-        usr1 = deref_or_null(tfind(&tmp1, &user_by_id, cmp_by_id));
-        usr2 = deref_or_null(tfind(&tmp2, &user_by_id, cmp_by_id));
+        usr1 = hashtab_find(&user_by_id, &tmp1);
+        usr2 = hashtab_find(&user_by_id, &tmp2);
     }
 
     if (usr1 == NULL || usr2 == NULL) {
         msg.body.challenge_r.error = NXID;
-        msg_send(fd, &msg);
-        log_debug("Non-existent user ID %d or %d", challenge->id1,
+        net_send(fd, &msg);
+        log_debug("Non-existent user ID %u or %u", challenge->id1,
                   challenge->id2);
         return;
     }
@@ -489,13 +1179,13 @@ static void handle_challenge(int fd, msg_challenge_t *challenge) {
             break;
         default:
             msg.body.challenge_r.error = INVARG;
-            msg_send(fd, &msg);
+            net_send(fd, &msg);
             return;
             break;
         }
         if (key != challenge->key) {
             msg.body.challenge_r.error = ICKEY;
-            msg_send(fd, &msg);
+            net_send(fd, &msg);
             log_debug("Wrong key");
             return;
         }
@@ -504,61 +1194,47 @@ static void handle_challenge(int fd, msg_challenge_t *challenge) {
     if (challenge->action == C_START) {
         if (usr1->state != UONLINE || usr2->state != UONLINE) {
             msg.body.challenge_r.error = ENGAGED;
-            msg_send(fd, &msg);
+            net_send(fd, &msg);
             return;
         }
         if (usr1->id == usr2->id) {
             msg.body.challenge_r.error = CHLSELF;
-            msg_send(fd, &msg);
+            net_send(fd, &msg);
             return;
         }
-        // Create challenge
+        // Users ask for one challenge at a time
+        challenge_cancel(usr1);
         challenge_t *ch = add_challenge();
         ch->state = ASKING;
         ch->user1 = challenge->id1, ch->user2 = challenge->id2;
         ch->hp1 = ch->hp2 = ch->maxhp1 = ch->maxhp2 = MAXHP;
         usr1->chid = ch->id;
-        // Relay challenge request to the other user
+        // Relay challenge request to the other user, who may not know usr1
+        if (usr2->sub)
+            sub_show(usr2, usr1);
         message_t *ch_msg = make_challenge();
         ch_msg->body.challenge = *challenge;
         ch_msg->body.challenge.chid = ch->id;
-        msg_send(usr2->fd, ch_msg);
-        free(ch_msg);
+        net_send(usr2->fd, ch_msg);
+        msg_free(ch_msg);
         return;
     }
 
     if (challenge->action == C_CANCEL) {
-        if (usr1->state == UONLINE) {
-            challenge_t *ch;
-            {
-                challenge_t tmp = {.id = usr1->chid};
-                ch = deref_or_null(tfind(&tmp, &ch_by_id, cmp_by_chid));
-            }
-            if (ch && ch->state == ASKING && ch->user1 == usr1->id) {
-                usr1->chid = 0;
-                tdelete(ch, &ch_by_id, cmp_by_chid);
-                user_info_t *user2;
-                {
-                    user_info_t tmp = {.id = ch->user2};
-                    user2 = deref_or_null(tfind(&tmp, &user_by_id, cmp_by_id));
-                }
-                if (user2) {
-                    msg.body.challenge_r.error = CANCELLED;
-                    msg_send(user2->fd, &msg);
-                }
-            }
-        }
+        if (usr1->state == UONLINE)
+            challenge_cancel(usr1);
         return;
     }
 
     challenge_t *ch;
     {
         challenge_t tmp = {.id = challenge->chid};
-        ch = deref_or_null(tfind(&tmp, &ch_by_id, cmp_by_chid));
+        ch = hashtab_find(&ch_by_id, &tmp);
     }
-    if (ch == NULL) {
+    // Ids of withdrawn challenges are soon handed out again
+    if (ch == NULL || ch->user1 != usr1->id || ch->user2 != usr2->id) {
         msg.body.challenge_r.error = NXCHID;
-        msg_send(fd, &msg);
+        net_send(fd, &msg);
         return;
     } else if (ch->state == STARTED) {
         // Ignore these requests; no reply needed
@@ -571,6 +1247,8 @@ static void handle_challenge(int fd, msg_challenge_t *challenge) {
         break;
     case C_ACCEPT: {
         if (usr1->state == UONLINE && usr2->state == UONLINE) {
+            // What usr2 was asking for itself is moot now
+            challenge_cancel(usr2);
             // Change user states & broadcast changes
             ch->state = STARTED;
             usr1->state = usr2->state = UBATTLING;
@@ -579,24 +1257,24 @@ static void handle_challenge(int fd, msg_challenge_t *challenge) {
             // Send reply to both users
             msg.body.challenge_r.error = ME_OK;
             msg.body.challenge_r.is_id1 = true;
-            msg_send(usr1->fd, &msg);
+            net_send(usr1->fd, &msg);
             msg.body.challenge_r.is_id1 = false;
-            msg_send(usr2->fd, &msg);
-            ch->turn_no = 0;
-            judge_turn(ch, -1);
+            net_send(usr2->fd, &msg);
+            battle_start(ch, usr1, usr2);
         } else {
             // Reply with error
             msg.body.challenge_r.error = ENGAGED;
-            msg_send(fd, &msg);
+            net_send(fd, &msg);
         }
     } break;
     case C_REJECT: {
         // Reply only when success and only to usr1
         if (ch->state == ASKING && ch->user2 == usr2->id) {
             msg.body.challenge_r.error = REJECTED;
-            msg_send(usr1->fd, &msg);
-            tdelete(ch, &ch_by_id, cmp_by_chid);
-            free(ch);
+            net_send(usr1->fd, &msg);
+            if (usr1->chid == ch->id)
+                usr1->chid = 0;
+            challenge_del(ch);
         }
     } break;
     case C_CANCEL: {
@@ -609,137 +1287,338 @@ static void handle_challenge(int fd, msg_challenge_t *challenge) {
     }
 }
 
-static void handle_turn(int fd, msg_turn_t *turn) {
-    challenge_t *ch;
-    {
-        challenge_t tmp = {.id = turn->chid};
-        ch = deref_or_null(tfind(&tmp, &ch_by_id, cmp_by_chid));
-        if (ch == NULL)
-            return;
+static void handle_entry(queue_entry_t *entry) {
+    switch (entry->kind) {
+    case EMSG:
+        log_debug("Got message from %d", entry->fd);
+        switch (entry->msg->head.kind) {
+        case JOIN:
+            handle_join(entry->fd, &entry->msg->body.join);
+            break;
+        case QUIT:
+            handle_quit(&entry->msg->body.quit);
+            break;
+        case CHALLENGE:
+            handle_challenge(entry->fd, &entry->msg->body.challenge);
+            break;
+        case SUBSCRIBE:
+            handle_subscribe(entry->fd, &entry->msg->body.subscribe);
+            break;
+        case LEADERBOARD:
+            handle_leaderboard(entry->fd, &entry->msg->body.leaderboard);
+            break;
+        }
+        msg_free(entry->msg);
+        queue_entry_free(entry);
+        break;
+    case EDISCONN:
+        handle_disconnect(entry->fd);
+        net_close(entry->fd);
+        queue_entry_free(entry);
+        break;
+    case ETICK:
+        uchange_flush();
+        queue_entry_free(entry);
+        break;
+    case EBATTLE_END:
+        battle_end(entry->ch);
+        queue_entry_free(entry);
+        break;
+    default:
+        // Only posted to battle strands
+        assert(0);
+        break;
     }
-    user_info_t *user;
-    {
-        user_info_t tmp = {.id = turn->user};
-        user = deref_or_null(tfind(&tmp, &user_by_id, cmp_by_id));
-        if (user == NULL)
-            return;
+}
+
+/* Posts an ETICK every uchange_tick ms, unless the last one is still
+ * queued. */
+static void *ticker(void *__reserved) {
+    struct timespec ts = {.tv_sec = uchange_tick / 1000,
+                          .tv_nsec = uchange_tick % 1000 * 1000000L};
+    while (1) {
+        nanosleep(&ts, NULL);
+        if (atomic_exchange(&tick_posted, true))
+            continue;
+        mpsc_add(incoming_queue, queue_entry_new(ETICK, -1, NULL), true);
     }
-    if (user->key != turn->key) {
-        return;
+    return 0;
+}
+
+static void *pkt_handler(void *__reserved) {
+    bool held = false;
+    while (1) {
+        // Handle whatever is ready, then submit all replies at once. While
+        // readers hold old chat views, come back for them before long.
+        void *batch[FLUSH_BATCH];
+        size_t n = held ? mpsc_take_batch_for(incoming_queue, batch,
+                                              FLUSH_BATCH, CHAT_RECLAIM_NS)
+                        : mpsc_take_batch(incoming_queue, batch, FLUSH_BATCH,
+                                          true);
+        for (size_t i = 0; i < n; ++i)
+            handle_entry(batch[i]);
+        // Changes are sent on ETICK otherwise
+        if (!uchange_tick)
+            subs_refresh();
+        // Before the replies, so that joiners hear the chat from now on
+        held = chat_view_publish();
+        net_flush();
     }
-    if (turn->user == ch->user1 && ch->acted1 == false) {
-        ch->act1 = turn->action;
-        ch->acted1 = true;
-    } else if (turn->user == ch->user2 && ch->acted2 == false) {
-        ch->act2 = turn->action;
-        ch->acted2 = true;
+    return 0;
+}
+
+/* Broadcasts a SENDMSG to the roster in chat_view if its sender is in it. */
+static void chat_task(void *pentry) {
+    queue_entry_t *entry = pentry;
+    message_t *msg = entry->msg;
+    msg_sendmsg_t *sm = &msg->body.sendmsg;
+    epoch_enter();
+    const chat_view_t *view =
+        atomic_load_explicit(&chat_view, memory_order_acquire);
+    if (view && chat_view_has(view, sm->id, sm->key)) {
+        sm->key = 0;
+        shared_msg_t shared;
+        shared_msg_init(&shared, msg);
+        for (size_t i = 0; i < view->page_cnt; ++i) {
+            const chat_page_t *page = view->pages[i];
+            for (size_t j = 0; j < page->cnt; ++j)
+                net_send_shared_conn(page->members[j].conn, &shared);
+        }
+        shared_msg_done(&shared);
     }
+    epoch_leave();
+    msg_free(msg);
+    queue_entry_free(entry);
+}
 
-    if (ch->acted1 && ch->acted2)
-        judge_turn(ch, -1);
+/* Takes TURN's from the reactors straight to the strand of their battle, and
+ * chat to the battle workers, which broadcast it without the game thread. */
+static bool dispatch_msg(queue_entry_t *entry) {
+    switch (entry->msg->head.kind) {
+    case TURN:
+        battle_post(entry);
+        return true;
+    case SENDMSG:
+        strand_post(&chat_strands[entry->fd % CHAT_STRANDS], chat_task, entry);
+        return true;
+    default:
+        return false;
+    }
 }
 
-static void handle_sendmsg(message_t *msg) {
-    msg_sendmsg_t *sm = &msg->body.sendmsg;
-    user_info_t *user;
-    {
-        user_info_t tmp = {.id = sm->id};
-        user = deref_or_null(tfind(&tmp, &user_by_id, cmp_by_id));
+/* Dropping these would leave logins, quits and battles hanging. Only asking
+ * for a challenge is limited, not answering one. */
+static bool rate_exempt(const message_t *msg) {
+    switch (msg->head.kind) {
+    case JOIN:
+    case QUIT:
+    case TURN:
+        return true;
+    case CHALLENGE:
+        return msg->body.challenge.action != C_START;
+    default:
+        return false;
     }
-    if (user && user->key == sm->key) {
-        sm->key = 0;
-        send_uinfo_wkst_t st = {
-            .type = MSG_TO_ALL, .except_fd = -1, .msg = msg};
-        twalk_r(user_by_id, send_user_info, &st);
+}
+
+/* Tells clients that wait for a reply that their request was dropped. Chat
+ * has no reply and is dropped silently. */
+static bool throttle_reply(const message_t *msg, message_t *reply) {
+    switch (msg->head.kind) {
+    case CHALLENGE: {
+        const msg_challenge_t *ch = &msg->body.challenge;
+        init_challenge_r(reply);
+        reply->body.challenge_r.error = THROTTLED;
+        reply->body.challenge_r.id1 = ch->id1;
+        reply->body.challenge_r.id2 = ch->id2;
+        reply->body.challenge_r.chid = ch->chid;
+        return true;
+    }
+    case SUBSCRIBE: {
+        const msg_subscribe_t *sub = &msg->body.subscribe;
+        init_msg_buf(reply, SUBSCRIBE_R);
+        reply->body.subscribe_r.error = THROTTLED;
+        reply->body.subscribe_r.order = sub->order;
+        reply->body.subscribe_r.offset = sub->offset;
+        reply->body.subscribe_r.limit = sub->limit;
+        return true;
+    }
+    case LEADERBOARD:
+        init_msg_buf(reply, LEADERBOARD_R);
+        reply->body.leaderboard_r.error = THROTTLED;
+        reply->body.leaderboard_r.offset = msg->body.leaderboard.offset;
+        return true;
+    default:
+        return false;
     }
 }
 
-static void *pkt_handler(void *__reserved) {
+static void pkt_handler_init() {
+    incoming_queue = mpsc_create(MAX_QUEUE_SIZE);
+    assert(incoming_queue);
+    xthread_create(pkt_handler, NULL);
+    // Battle workers send, and flush when they run out of tasks
+    battle_sched = sched_create(battle_worker_cnt, net_flush);
+    battle_strands = xcalloc(BATTLE_STRANDS, sizeof(*battle_strands));
+    for (size_t i = 0; i < BATTLE_STRANDS; ++i) {
+        battle_strand_t *bs = &battle_strands[i];
+        strand_init(&bs->strand, battle_sched);
+        hashtab_init(&bs->battles, hash_by_chid, eq_by_chid);
+        bs->seed = random();
+    }
+    for (size_t i = 0; i < CHAT_STRANDS; ++i)
+        strand_init(&chat_strands[i], battle_sched);
+    if (uchange_tick)
+        xthread_create(ticker, NULL);
+}
+
+/* Logs the allocator and connection statistics whenever SIGUSR1 arrives. */
+static void *stats_reporter(void *__reserved) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
     while (1) {
-        void *p;
-        queue_entry_t *entry;
-        if (queue_take(incoming_queue, &p, true) == QOK) {
-            entry = p;
-            switch (entry->kind) {
-            case EMSG:
-                log_debug("Got message from %d", entry->fd);
-                switch (entry->msg->head.kind) {
-                case JOIN:
-                    handle_join(entry->fd, &entry->msg->body.join);
-                    break;
-                case QUIT:
-                    handle_quit(&entry->msg->body.quit);
-                    break;
-                case CHALLENGE:
-                    handle_challenge(entry->fd, &entry->msg->body.challenge);
-                    break;
-                case TURN:
-                    handle_turn(entry->fd, &entry->msg->body.turn);
-                    break;
-                case SENDMSG:
-                    handle_sendmsg(entry->msg);
-                    break;
-                }
-                free(entry->msg);
-                free(entry);
-                break;
-            case EDISCONN:
-                handle_disconnect(entry->fd);
-                // TODO: handle close
-                // close(entry->fd);
-                break;
-            }
-        } else {
-            assert(0);
+        int sig;
+        if (sigwait(&set, &sig) == 0) {
+            pool_log_stats();
+            net_log_stats();
         }
     }
     return 0;
 }
 
-static void pkt_handler_init(pthread_t *thread) {
-    incoming_queue = queue_create(MAX_QUEUE_SIZE);
-    assert(incoming_queue);
-    int err = pthread_create(thread, NULL, pkt_handler, NULL);
-    if (err != 0)
-        ppanic("%s: pthread_create()", __func__);
-}
-
 void signal_handlers_init() {
     // ignore SIGPIPE
     signal(SIGPIPE, SIG_IGN);
+    // SIGUSR1 is only taken by stats_reporter; the threads started from here
+    // on inherit the mask
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    xthread_create(stats_reporter, NULL);
     // TODO: handle C-c
 }
 
+static bool parse_backend(const char *arg, void *dest) {
+    if (strcmp(arg, "epoll") == 0) {
+        *(net_backend_t *)dest = NET_EPOLL;
+    } else if (strcmp(arg, "uring") == 0) {
+        *(net_backend_t *)dest = NET_URING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_slow_policy(const char *arg, void *dest) {
+    if (strcmp(arg, "disconnect") == 0) {
+        *(slow_policy_t *)dest = SLOW_DISCONNECT;
+    } else if (strcmp(arg, "drop-roster") == 0) {
+        *(slow_policy_t *)dest = SLOW_DROP_ROSTER;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char **argv) {
     set_loglevel(LOGLV_MAX);
 
     char listen_addr[ADDR_MAX_LEN] = "0.0.0.0";
-    uint32_t port = DEFAULT_PORT;
+    uint32_t port = DEFAULT_PORT, reactors = 1;
+    uint32_t ring_entries = DEFAULT_RING_ENTRIES;
+    net_backend_t backend = NET_EPOLL;
+    bool reuseport = false;
+    uint32_t outbuf_limit = DEFAULT_OUTBUF_LIMIT;
+    slow_policy_t slow_policy = SLOW_DISCONNECT;
+    uint32_t max_conns = 0, thread_stack = DEFAULT_THREAD_STACK_KB;
+    uint32_t rate_limit = DEFAULT_RATE_LIMIT, chat_rate = DEFAULT_CHAT_RATE;
+    const app_option_t options[] = {
+        {"max-users", "N",
+         "Most users online at once (default: 65535; more need "
+         "--id32-only)",
+         opt_parse_uint, &max_users},
+        {"id32-only", NULL,
+         "Refuse clients that only understand 16-bit ids, which could not "
+         "tell users and challenges apart beyond 65535",
+         opt_parse_flag, &id32_only},
+        {"max-conns", "N",
+         "Most connections open at once; more are reset as soon as they are "
+         "accepted (default: as many as the open file limit allows)",
+         opt_parse_uint, &max_conns},
+        {"backend", "epoll|uring", "Network backend (default: epoll)",
+         parse_backend, &backend},
+        {"reactors", "N", "Number of network reactor threads (default: 1)",
+         opt_parse_uint, &reactors},
+        {"ring-entries", "N",
+         "Submission queue size of each io_uring; operations wait for room "
+         "when it is full (default: 4096)",
+         opt_parse_uint, &ring_entries},
+        {"reuseport", NULL,
+         "Give each reactor its own SO_REUSEPORT listener, pinned to a core",
+         opt_parse_flag, &reuseport},
+        {"outbuf-limit", "BYTES",
+         "Bytes queued for a client before it is considered slow "
+         "(default: 262144)",
+         opt_parse_uint, &outbuf_limit},
+        {"uchange-tick", "MS",
+         "Coalesce roster updates and broadcast them every MS milliseconds, "
+         "which bounds the added latency (default: 0, broadcast at once)",
+         opt_parse_uint, &uchange_tick},
+        {"slow-client", "disconnect|drop-roster",
+         "What to do with slow clients (default: disconnect)",
+         parse_slow_policy, &slow_policy},
+        {"battle-workers", "N",
+         "Threads that run battles and broadcast chat, which they take from "
+         "each other when busy (default: 1)",
+         opt_parse_uint, &battle_worker_cnt},
+        {"rate-limit", "N",
+         "Messages a client may send a second, in bursts of twice that; "
+         "the rest are dropped, and requests answered with THROTTLED. "
+         "JOIN, QUIT, TURN and answers to challenges are never dropped "
+         "(default: 50, 0 for no limit)",
+         opt_parse_uint, &rate_limit},
+        {"chat-rate", "N",
+         "Likewise for SENDMSG and for challenges asked each (default: 5)",
+         opt_parse_uint, &chat_rate},
+        {"thread-stack", "KB",
+         "Stack size of every thread the server starts (default: 256)",
+         opt_parse_uint, &thread_stack},
+        {0}};
     parse_args(argc, argv, listen_addr, ADDR_MAX_LEN, &port,
-               argc == 0 ? APPNAME : argv[0], "LISTEN_ADDR");
+               argc == 0 ? APPNAME : argv[0], "LISTEN_ADDR", options);
+    if (reactors == 0 || ring_entries == 0 ||
+        ring_entries > MAX_RING_ENTRIES || max_users == 0 ||
+        (max_users > UINT16_MAX && !id32_only) ||
+        outbuf_limit < sizeof(message_t) ||
+        battle_worker_cnt == 0 || battle_worker_cnt > MAX_BATTLE_WORKERS ||
+        thread_stack * 1024ul < PTHREAD_STACK_MIN) {
+        display_help(true, argc == 0 ? APPNAME : argv[0], "LISTEN_ADDR",
+                     options);
+    }
+    set_thread_stack_size(thread_stack * 1024ul);
     signal_handlers_init();
     random_init();
     model_init();
-    pthread_t pkg_handler_thread;
-    pkt_handler_init(&pkg_handler_thread);
-
-    int listen_fd;
-    listen_fd = do_listen(listen_addr, port);
-    log_info("Listening at %s:%u...", listen_addr, port);
-    while (true) {
-        int fd;
-        struct sockaddr_in sin;
-        socklen_t addrlen = sizeof(sin);
-
-        if ((fd = accept(listen_fd, (struct sockaddr *)&sin, &addrlen)) != -1) {
-            serve_arg_t *arg = xmalloc(sizeof(*arg));
-            arg->fd = fd;
-            arg->sin = sin;
-            pthread_t p;
-            int err = pthread_create(&p, NULL, serve, arg);
-            if (err != 0) {
-                ppanic("Accepting connection: pthread_create()");
-            }
-        }
-    }
+    pkt_handler_init();
+
+    net_config_t cfg = {.listen_addr = listen_addr,
+                        .port = port,
+                        .backend = backend,
+                        .reactors = reactors,
+                        .ring_entries = ring_entries,
+                        .reuseport = reuseport,
+                        .outbuf_limit = outbuf_limit,
+                        .slow_policy = slow_policy,
+                        .max_conns = max_conns,
+                        .conn_rate = {rate_limit,
+                                      rate_limit * RATE_BURST_SECONDS},
+                        .rate_exempt = rate_exempt,
+                        .throttle_reply = throttle_reply,
+                        .dispatch = dispatch_msg};
+    // Every client may flood these to every other one
+    cfg.kind_rate[SENDMSG] = cfg.kind_rate[CHALLENGE] =
+        (rate_limit_t){chat_rate, chat_rate * RATE_BURST_SECONDS};
+    net_run(&cfg, incoming_queue);
 }